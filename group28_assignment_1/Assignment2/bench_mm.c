@@ -0,0 +1,372 @@
+/**
+ * @file   bench_mm.c
+ * @brief  Trace-driven benchmark of simple_malloc against the C library malloc.
+ *
+ * Replays a recorded malloc/free/realloc trace against both allocators and
+ * reports throughput, per-operation latency percentiles, peak footprint and
+ * fragmentation for each. simple_malloc runs once per placement policy and also
+ * reports how many free blocks a search examines on average. Every replay runs in
+ * a process of its own, so no run starts on an arena an earlier one grew, and the
+ * resident set shows what each touched at page granularity. Footprints count from
+ * the start of the replay, leaving out the harness's own arrays.
+ *
+ * Text traces hold one operation per line ('#' starts a comment):
+ *
+ *   a <id> <size>    allocate size bytes and remember the result as id
+ *   r <id> <size>    reallocate block id to size bytes
+ *   f <id>           free block id
+ *
+ * Binary traces start with the 4 bytes "MMTR" followed by TraceOp records.
+ *
+ * Usage:
+ *   malloc_bench <trace>              replay a trace file
+ *   malloc_bench -g <ops> [seed]      write a synthetic text trace to stdout
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "mm.h"
+
+#define OP_ALLOC    'a'
+#define OP_REALLOC  'r'
+#define OP_FREE     'f'
+
+/* One trace operation, also the on-disk record of binary traces */
+typedef struct {
+    uint8_t op;
+    uint8_t pad[3];
+    uint32_t id;
+    uint64_t size;
+} TraceOp;
+
+typedef struct {
+    TraceOp *ops;
+    size_t count;
+    uint32_t max_id;
+} Trace;
+
+/* The allocator under test */
+typedef struct {
+    const char *name;
+    void *(*alloc)(size_t);
+    void *(*resize)(void *, size_t);
+    void (*release)(void *);
+    size_t (*footprint)(void);     // Bytes the allocator holds from the OS
+    int policy;                    // Placement policy of simple_malloc, -1 for other allocators
+} Allocator;
+
+static size_t simple_footprint(void) {
+    return simple_mm_stats().bytes_mapped;
+}
+
+static size_t libc_footprint(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+/* Resident bytes of the process; read without stdio, which would allocate from glibc malloc */
+static size_t resident_bytes(void) {
+    char text[128];
+    unsigned long pages, resident;
+    int fd = open("/proc/self/statm", O_RDONLY);
+    ssize_t length = fd >= 0 ? read(fd, text, sizeof(text) - 1) : -1;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (length <= 0) {
+        return 0;
+    }
+    text[length] = '\0';
+    return sscanf(text, "%lu %lu", &pages, &resident) == 2 ? resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
+
+static const Allocator allocators[] = {
+    { "simple_malloc first fit", simple_malloc, simple_realloc, simple_free, simple_footprint, MM_FIT_FIRST },
+    { "simple_malloc next fit",  simple_malloc, simple_realloc, simple_free, simple_footprint, MM_FIT_NEXT  },
+    { "simple_malloc best fit",  simple_malloc, simple_realloc, simple_free, simple_footprint, MM_FIT_BEST  },
+    { "glibc malloc",            malloc,        realloc,        free,        libc_footprint,   -1           },
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Appends an operation, growing the array as needed */
+static int trace_push(Trace *trace, size_t *capacity, TraceOp op) {
+    if (trace->count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 4096;
+        TraceOp *ops = realloc(trace->ops, grown * sizeof(TraceOp));
+        if (ops == NULL) {
+            return -1;
+        }
+        trace->ops = ops;
+        *capacity = grown;
+    }
+    trace->ops[trace->count++] = op;
+    if (op.id > trace->max_id) {
+        trace->max_id = op.id;
+    }
+    return 0;
+}
+
+/* Loads a text or binary trace */
+static int trace_load(const char *path, Trace *trace) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    size_t capacity = 0;
+    char magic[4];
+    memset(trace, 0, sizeof(*trace));
+
+    if (fread(magic, 1, 4, file) == 4 && memcmp(magic, "MMTR", 4) == 0) {
+        TraceOp op;
+        while (fread(&op, sizeof(op), 1, file) == 1) {
+            if (trace_push(trace, &capacity, op) < 0) {
+                fclose(file);
+                return -1;
+            }
+        }
+    } else {
+        char line[256];
+        rewind(file);
+        while (fgets(line, sizeof(line), file) != NULL) {
+            char kind;
+            unsigned long id;
+            unsigned long long size = 0;
+            if (line[0] == '#' || sscanf(line, " %c %lu %llu", &kind, &id, &size) < 2) {
+                continue;
+            }
+            if (kind != OP_ALLOC && kind != OP_REALLOC && kind != OP_FREE) {
+                fprintf(stderr, "%s: unknown operation '%c'\n", path, kind);
+                fclose(file);
+                return -1;
+            }
+            TraceOp op = { .op = (uint8_t)kind, .id = (uint32_t)id, .size = size };
+            if (trace_push(trace, &capacity, op) < 0) {
+                fclose(file);
+                return -1;
+            }
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/* Writes a synthetic trace: mostly small objects with a tail of large ones, random lifetimes */
+static void trace_generate(size_t ops, unsigned seed) {
+    const uint32_t slots = 4096;
+    uint8_t *live = calloc(slots, 1);
+    srand(seed);
+
+    printf("# synthetic trace: %zu operations, seed %u\n", ops, seed);
+    for (size_t n = 0; n < ops; n++) {
+        uint32_t id = rand() % slots;
+        unsigned long size = rand() % 8 == 0 ? 512 + rand() % 65536 : 8 + rand() % 248;
+        if (!live[id]) {
+            printf("a %u %lu\n", id, size);
+            live[id] = 1;
+        } else if (rand() % 5 == 0) {
+            printf("r %u %lu\n", id, size);
+        } else {
+            printf("f %u\n", id);
+            live[id] = 0;
+        }
+    }
+    for (uint32_t id = 0; id < slots; id++) {
+        if (live[id]) {
+            printf("f %u\n", id);
+        }
+    }
+    free(live);
+}
+
+/* Prints the latency percentiles of one operation kind */
+static void report_latency(const char *label, uint32_t *samples, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    qsort(samples, count, sizeof(uint32_t), compare_u32);
+    printf("  %-8s %9zu ops   p50 %6u ns   p99 %6u ns   max %8u ns\n", label, count,
+           samples[count / 2], samples[count * 99 / 100], samples[count - 1]);
+}
+
+/* Replays the trace against one allocator and prints its results */
+static int replay(const Allocator *allocator, const Trace *trace) {
+    if (allocator->policy >= 0 && simple_mm_set_fit_policy(allocator->policy) < 0) {
+        printf("%s\n  not available in this build\n", allocator->name);
+        return -1;
+    }
+    MMStats search_start = simple_mm_stats();
+
+    void **blocks = calloc(trace->max_id + 1, sizeof(void *));
+    size_t *sizes = calloc(trace->max_id + 1, sizeof(size_t));
+    uint32_t *latency[3];
+    size_t counts[3] = { 0, 0, 0 };
+    for (int k = 0; k < 3; k++) {
+        latency[k] = malloc(trace->count * sizeof(uint32_t));
+        memset(latency[k], 0, trace->count * sizeof(uint32_t));  // Resident before the baseline below
+    }
+
+    size_t resident_start = resident_bytes(), peak_resident = resident_start;
+    // Footprints count from here, past the trace and the arrays above, which glibc malloc holds too
+    size_t baseline = allocator->footprint();
+    size_t live_bytes = 0, peak_live = 0, peak_footprint = baseline;
+    size_t failures = 0;
+    uint64_t total_ns = 0;
+
+    for (size_t n = 0; n < trace->count; n++) {
+        const TraceOp *op = &trace->ops[n];
+        uint64_t start, elapsed;
+        int kind;
+
+        switch (op->op) {
+        case OP_ALLOC:
+            if (blocks[op->id] != NULL) {
+                continue;  // Id reused without a free: keep the first block
+            }
+            kind = 0;
+            start = now_ns();
+            blocks[op->id] = allocator->alloc(op->size);
+            elapsed = now_ns() - start;
+            if (blocks[op->id] == NULL) {
+                failures++;
+                break;
+            }
+            memset(blocks[op->id], 0xa5, op->size < 64 ? op->size : 64);  // Touch the block
+            sizes[op->id] = op->size;
+            live_bytes += op->size;
+            break;
+        case OP_REALLOC: {
+            kind = 1;
+            start = now_ns();
+            void *moved = allocator->resize(blocks[op->id], op->size);
+            elapsed = now_ns() - start;
+            if (moved == NULL && op->size != 0) {
+                failures++;
+                break;
+            }
+            live_bytes = live_bytes - sizes[op->id] + op->size;
+            blocks[op->id] = moved;
+            sizes[op->id] = op->size;
+            break;
+        }
+        default:
+            if (blocks[op->id] == NULL) {
+                continue;
+            }
+            kind = 2;
+            start = now_ns();
+            allocator->release(blocks[op->id]);
+            elapsed = now_ns() - start;
+            blocks[op->id] = NULL;
+            live_bytes -= sizes[op->id];
+            sizes[op->id] = 0;
+            break;
+        }
+
+        latency[kind][counts[kind]++] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+        total_ns += elapsed;
+
+        // Sample the footprint whenever the live set reaches a new high
+        if (live_bytes > peak_live) {
+            peak_live = live_bytes;
+            size_t footprint = allocator->footprint();
+            if (footprint > peak_footprint) {
+                peak_footprint = footprint;
+            }
+            size_t resident = resident_bytes();
+            if (resident > peak_resident) {
+                peak_resident = resident;
+            }
+        }
+    }
+
+    size_t ops = counts[0] + counts[1] + counts[2];
+    printf("%s\n", allocator->name);
+    printf("  throughput       %.2f Mops/s (%zu ops in %.3f ms, %zu failed)\n",
+           total_ns ? ops * 1e3 / total_ns : 0.0, ops, total_ns / 1e6, failures);
+    report_latency("malloc", latency[0], counts[0]);
+    report_latency("realloc", latency[1], counts[1]);
+    report_latency("free", latency[2], counts[2]);
+    peak_footprint -= baseline;
+    printf("  peak live        %zu bytes\n", peak_live);
+    printf("  peak footprint   %zu bytes\n", peak_footprint);
+    printf("  peak resident    %zu bytes over the start of the replay\n", peak_resident - resident_start);
+    printf("  fragmentation    %.1f%% of the peak footprint not holding live data\n",
+           peak_footprint ? 100.0 * (1.0 - (double)peak_live / peak_footprint) : 0.0);
+    if (allocator->policy >= 0) {
+        MMStats search_end = simple_mm_stats();
+        size_t searches = search_end.searches - search_start.searches;
+        printf("  search length    %.2f free blocks examined per search (%zu searches)\n",
+               searches ? (double)(search_end.blocks_scanned - search_start.blocks_scanned) / searches : 0.0,
+               searches);
+    }
+
+    for (uint32_t id = 0; id <= trace->max_id; id++) {
+        if (blocks[id] != NULL) {
+            allocator->release(blocks[id]);
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        free(latency[k]);
+    }
+    free(blocks);
+    free(sizes);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "-g") == 0) {
+        trace_generate(strtoull(argv[2], NULL, 10), argc > 3 ? (unsigned)atoi(argv[3]) : 1);
+        return 0;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace> | -g <ops> [seed]\n", argv[0]);
+        return 2;
+    }
+
+    Trace trace;
+    if (trace_load(argv[1], &trace) < 0) {
+        return 1;
+    }
+    printf("trace %s: %zu operations, %u ids\n\n", argv[1], trace.count, trace.max_id + 1);
+
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            replay(&allocators[i], &trace);
+            printf("\n");
+            fflush(stdout);
+            _exit(0);
+        }
+
+        int status;
+        if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status)) {
+            printf("%s\n  replay did not complete\n\n", allocators[i].name);
+        }
+    }
+
+    free(trace.ops);
+    return 0;
+}
@@ -0,0 +1,152 @@
+/**
+ * @file   bench_pages.c
+ * @brief  Compares simple_malloc on small pages and on huge pages.
+ *
+ * Fills a large arena with small blocks, then frees and reallocates blocks at
+ * random so every operation touches headers far apart in the arena. Each page
+ * mode runs in its own child process, on a fresh arena, and reports the
+ * throughput, the data-TLB misses counted by perf (when the kernel allows it)
+ * and how much of the heap really ended up on huge pages.
+ *
+ * Usage:
+ *   page_bench [live blocks] [operations]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "mm.h"
+
+static const struct {
+    int mode;
+    const char *name;
+} modes[] = {
+    { MM_PAGES_SMALL,       "4 KB pages" },
+    { MM_PAGES_TRANSPARENT, "transparent huge pages" },
+    { MM_PAGES_EXPLICIT,    "explicit huge pages" },
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Opens a user-space counter of data-TLB read misses, or returns -1 where perf is unavailable */
+static int open_dtlb_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Kilobytes of anonymous memory on transparent huge pages, from /proc/self/smaps_rollup */
+static long anon_huge_kb(void) {
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    long kb = -1;
+
+    if (file == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return kb;
+}
+
+/* Runs the workload on the current page mode and prints one report */
+static void run(const char *name, size_t live, size_t ops) {
+    void **blocks = malloc(live * sizeof(void *));
+    uint64_t seed = 88172645463325252ull;
+
+    // One segment for the whole heap, then fill it so later operations land all over it
+    simple_mm_init(live * 96);
+    for (size_t i = 0; i < live; i++) {
+        blocks[i] = simple_malloc(16 + (i * 40503u) % 112);
+        *(size_t *)blocks[i] = i;
+    }
+
+    int counter = open_dtlb_counter();
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    uint64_t start = now_ns();
+    size_t checksum = 0;
+    for (size_t n = 0; n < ops; n++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        size_t i = seed % live;
+
+        checksum += *(size_t *)blocks[i];
+        simple_free(blocks[i]);
+        blocks[i] = simple_malloc(16 + (seed >> 40) % 112);
+        *(size_t *)blocks[i] = n;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    long long misses = -1;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(counter);
+    }
+
+    printf("%s\n", name);
+    printf("  throughput       %.2f Mops/s (%zu free+malloc pairs in %.1f ms)\n",
+           ops * 1e3 / elapsed, ops, elapsed / 1e6);
+    if (misses >= 0) {
+        printf("  dTLB misses      %lld (%.3f per pair)\n", misses, (double)misses / ops);
+    } else {
+        printf("  dTLB misses      unavailable (perf events not permitted)\n");
+    }
+    printf("  heap mapped      %zu bytes, %ld kB on transparent huge pages\n",
+           simple_mm_stats().bytes_mapped, anon_huge_kb());
+    printf("  checksum         %zu\n\n", checksum);
+    free(blocks);
+}
+
+int main(int argc, char **argv) {
+    size_t live = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 4000000;
+
+    printf("%zu live blocks, %zu operations\n\n", live, ops);
+    fflush(stdout);
+
+    // A child per mode, as every mode needs an arena of its own
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        pid_t child = fork();
+        if (child == 0) {
+            memory_set_page_mode(modes[m].mode);
+            run(modes[m].name, live, ops);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+    }
+    return 0;
+}
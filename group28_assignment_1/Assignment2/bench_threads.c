@@ -0,0 +1,254 @@
+/**
+ * @file   bench_threads.c
+ * @brief  Multithreaded scalability benchmark of simple_malloc against the C library malloc.
+ *
+ * Runs three standard allocator workloads on 1 up to the number of online
+ * cores and reports throughput and scaling efficiency, that is throughput
+ * divided by the thread count times the single-thread throughput:
+ *
+ *   thread-local       every thread allocates a batch of blocks and frees it again
+ *   larson             every thread replaces random blocks of its own slot array
+ *                      with blocks of random size (Larson and Krishnan)
+ *   producer-consumer  thread i allocates blocks and hands them to thread i + 1
+ *                      through a ring, which frees them (cross-thread frees)
+ *
+ * Given a block size, every request has that size and the lock-free pool of
+ * pool.h joins the comparison, as for queue nodes passed between threads.
+ *
+ * Usage:
+ *   mt_bench [max threads] [operations per thread] [block size]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mm.h"
+#include "pool.h"
+
+#define BATCH       64      // Blocks per thread-local round
+#define SLOTS       1024    // Live blocks per larson thread
+#define RING_SIZE   256     // Blocks in flight between a producer and its consumer (power of two)
+#define CACHE_LINE  64
+
+/* The allocator under test */
+typedef struct {
+    const char *name;
+    void *(*alloc)(size_t);
+    void (*release)(void *);
+} Allocator;
+
+static BlockPool *pool = NULL;        // Serves fixed-size runs only
+static size_t fixed_size = 0;         // Size of every request, 0 for the random mix
+
+static void *pool_bench_alloc(size_t size) {
+    return pool_alloc(pool);
+}
+
+static void pool_bench_free(void *block) {
+    pool_free(pool, block);
+}
+
+static const Allocator allocators[] = {
+    { "simple_malloc",  simple_malloc,    simple_free     },
+    { "glibc malloc",   malloc,           free            },
+    { "lock-free pool", pool_bench_alloc, pool_bench_free },  // Last: fixed-size runs only
+};
+
+/* Single-producer single-consumer ring between two neighbouring threads */
+typedef struct {
+    _Alignas(CACHE_LINE) size_t head;   // Next slot to fill, written by the producer
+    _Alignas(CACHE_LINE) size_t tail;   // Next slot to drain, written by the consumer
+    void *slots[RING_SIZE];
+} Ring;
+
+typedef struct {
+    const Allocator *allocator;
+    pthread_barrier_t *start;
+    Ring *rings;
+    int id;
+    int threads;
+    size_t ops;
+    unsigned seed;
+} Worker;
+
+typedef struct {
+    const char *name;
+    void *(*run)(void *);
+} Workload;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Small xorshift generator, one state per thread */
+static unsigned next_random(unsigned *state) {
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* Block sizes: mostly small objects with an occasional larger one */
+static size_t random_size(unsigned *state) {
+    if (fixed_size != 0) {
+        return fixed_size;
+    }
+    unsigned r = next_random(state);
+    return r % 16 == 0 ? 256 + r % 3840 : 8 + r % 120;
+}
+
+static void *thread_local_run(void *arg) {
+    Worker *w = arg;
+    void *blocks[BATCH];
+    pthread_barrier_wait(w->start);
+
+    for (size_t done = 0; done < w->ops; done += 2 * BATCH) {
+        for (int i = 0; i < BATCH; i++) {
+            blocks[i] = w->allocator->alloc(random_size(&w->seed));
+            *(char *)blocks[i] = 1;
+        }
+        for (int i = 0; i < BATCH; i++) {
+            w->allocator->release(blocks[i]);
+        }
+    }
+    return NULL;
+}
+
+static void *larson_run(void *arg) {
+    Worker *w = arg;
+    void **slots = calloc(SLOTS, sizeof(void *));
+    pthread_barrier_wait(w->start);
+
+    for (size_t done = 0; done < w->ops; done += 2) {
+        unsigned slot = next_random(&w->seed) % SLOTS;
+        w->allocator->release(slots[slot]);
+        slots[slot] = w->allocator->alloc(random_size(&w->seed));
+        *(char *)slots[slot] = 1;
+    }
+    for (int i = 0; i < SLOTS; i++) {
+        w->allocator->release(slots[i]);
+    }
+    free(slots);
+    return NULL;
+}
+
+static void *producer_consumer_run(void *arg) {
+    Worker *w = arg;
+    Ring *out = &w->rings[w->id];
+    Ring *in = &w->rings[(w->id + w->threads - 1) % w->threads];
+    size_t produced = 0, consumed = 0, per_side = w->ops / 2;
+    pthread_barrier_wait(w->start);
+
+    // Interleave producing and consuming so a ring never blocks both neighbours
+    while (produced < per_side || consumed < per_side) {
+        int progress = 0;
+
+        size_t head = out->head;
+        if (produced < per_side && head - __atomic_load_n(&out->tail, __ATOMIC_ACQUIRE) < RING_SIZE) {
+            void *block = w->allocator->alloc(random_size(&w->seed));
+            *(char *)block = 1;
+            out->slots[head % RING_SIZE] = block;
+            __atomic_store_n(&out->head, head + 1, __ATOMIC_RELEASE);
+            produced++;
+            progress = 1;
+        }
+
+        size_t tail = in->tail;
+        if (tail != __atomic_load_n(&in->head, __ATOMIC_ACQUIRE)) {
+            w->allocator->release(in->slots[tail % RING_SIZE]);
+            __atomic_store_n(&in->tail, tail + 1, __ATOMIC_RELEASE);
+            consumed++;
+            progress = 1;
+        }
+
+        if (!progress) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static const Workload workloads[] = {
+    { "thread-local",      thread_local_run },
+    { "larson",            larson_run },
+    { "producer-consumer", producer_consumer_run },
+};
+
+/* Runs one workload on the given number of threads and returns its throughput in Mops/s */
+static double run(const Workload *workload, const Allocator *allocator, int threads, size_t ops) {
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    Worker *workers = malloc(threads * sizeof(Worker));
+    Ring *rings = aligned_alloc(CACHE_LINE, threads * sizeof(Ring));
+    pthread_barrier_t start;
+
+    memset(rings, 0, threads * sizeof(Ring));
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker){ allocator, &start, rings, i, threads, ops, 2463534242u + 7919u * i };
+        pthread_create(&ids[i], NULL, workload->run, &workers[i]);
+    }
+
+    pthread_barrier_wait(&start);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    uint64_t elapsed = now_ns() - begin;
+
+    pthread_barrier_destroy(&start);
+    free(rings);
+    free(workers);
+    free(ids);
+    return elapsed ? (double)ops * threads * 1e3 / elapsed : 0.0;
+}
+
+int main(int argc, char **argv) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)(cores > 0 ? cores : 1);
+    size_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+    fixed_size = argc > 3 ? strtoull(argv[3], NULL, 10) : 0;
+    if (max_threads < 1 || ops == 0 || (argc > 3 && (pool = pool_create(fixed_size)) == NULL)) {
+        fprintf(stderr, "usage: %s [max threads] [operations per thread] [block size]\n", argv[0]);
+        return 2;
+    }
+    size_t count = sizeof(allocators) / sizeof(allocators[0]) - (pool == NULL);
+
+    printf("%ld online cores, 1 to %d threads, %zu operations per thread", cores, max_threads, ops);
+    if (fixed_size != 0) {
+        printf(", %zu-byte blocks", fixed_size);
+    }
+    printf("\n");
+    for (size_t k = 0; k < sizeof(workloads) / sizeof(workloads[0]); k++) {
+        printf("\n%s\n", workloads[k].name);
+        printf("  threads");
+        for (size_t a = 0; a < count; a++) {
+            printf("   %14s Mops/s  scaling", allocators[a].name);
+        }
+        printf("\n");
+
+        double single[sizeof(allocators) / sizeof(allocators[0])];
+        for (int threads = 1; threads <= max_threads; threads++) {
+            printf("  %7d", threads);
+            for (size_t a = 0; a < count; a++) {
+                double throughput = run(&workloads[k], &allocators[a], threads, ops);
+                if (threads == 1) {
+                    single[a] = throughput;
+                }
+                printf("   %21.2f  %6.0f%%", throughput,
+                       single[a] ? 100.0 * throughput / (threads * single[a]) : 0.0);
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
@@ -16,11 +16,24 @@
  *
  */
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <check.h>
 #include "mm.h"
+#include "slab.h"
+#include "region.h"
+#include "pool.h"
+
+#ifdef MM_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 /* Choose which malloc/free to test */
 #define MALLOC simple_malloc
@@ -325,6 +338,7 @@ START_TEST(test_multiple_allocations)
 }
 END_TEST
 
+#ifndef MM_BACKEND_BUDDY
 START_TEST(test_next_fit_allocation)
 {
     // Allocate several blocks of different sizes
@@ -352,6 +366,7 @@ START_TEST(test_next_fit_allocation)
     FREE(block4);
 }
 END_TEST
+#endif
 
 
 
@@ -377,8 +392,1050 @@ START_TEST(test_first_fit_vs_next_fit)
 }
 END_TEST
 
+START_TEST(test_free_list_reuse)
+{
+    // Free a block between two live blocks, so it cannot coalesce away
+    int *block1 = MALLOC(12 * sizeof(int));
+    int *block2 = MALLOC(12 * sizeof(int));
+    int *block3 = MALLOC(12 * sizeof(int));
+
+    ck_assert(block1 != NULL);
+    ck_assert(block2 != NULL);
+    ck_assert(block3 != NULL);
+
+    FREE(block2);
+
+    // Its size class list should hand the same block straight back
+    int *block4 = MALLOC(12 * sizeof(int));
+    ck_assert(block4 == block2);
+
+    FREE(block1);
+    FREE(block3);
+    FREE(block4);
+}
+END_TEST
+
+
+#ifndef MM_BACKEND_BUDDY
+START_TEST(test_coalesce_with_previous)
+{
+    // Neighbours with an unusual size, above any per-thread cache, so they reach the arena
+    char *block1 = MALLOC(1000);
+    char *block2 = MALLOC(1000);
+    char *block3 = MALLOC(1000);
+
+    ck_assert(block1 != NULL && block2 != NULL && block3 != NULL);
+    ck_assert(block2 > block1);
+
+    // Freeing block2 after block1 must merge it into its left neighbour
+    FREE(block1);
+    FREE(block2);
+
+    char *merged = MALLOC(block2 - block1 + 1000);
+    ck_assert(merged == block1);
+
+    FREE(merged);
+    FREE(block3);
+}
+END_TEST
+#else
+START_TEST(test_buddy_merge)
+{
+    MMStats before = simple_mm_stats();
+
+    // 1000 bytes plus the header fill a 1024-byte block, which starts on a 1024-byte boundary
+    char *block1 = MALLOC(1000);
+    char *block2 = MALLOC(1000);
+    ck_assert(block1 != NULL && block2 != NULL);
+    ck_assert(((uintptr_t)block1 & 1023) == ((uintptr_t)block2 & 1023));
+
+    // Freeing both must merge every split back, leaving the free blocks as they were
+    FREE(block1);
+    FREE(block2);
+
+    MMStats after = simple_mm_stats();
+    ck_assert_uint_eq(after.free_blocks, before.free_blocks);
+    ck_assert_uint_eq(after.largest_free, before.largest_free);
+    ck_assert_uint_eq(after.bytes_in_use, before.bytes_in_use);
+}
+END_TEST
+
+#define ALIGNED_PAIRS 64
+
+START_TEST(test_buddy_aligned_natural)
+{
+    MMStats before = simple_mm_stats();
+
+    // A page-aligned page is a 4 KB block on its own, with no header in front
+    char *page = simple_aligned_alloc(4096, 4096);
+    ck_assert(page != NULL && ((uintptr_t)page & 4095) == 0);
+    ck_assert_uint_eq(simple_malloc_usable_size(page), 4096);
+    ck_assert_uint_eq(simple_mm_stats().bytes_in_use, before.bytes_in_use + 4096);
+    memset(page, 0x33, 4096);
+
+    // Headerless blocks filled to look like free headers must not be merged with their buddies
+    char *aligned[ALIGNED_PAIRS];
+    char *small[ALIGNED_PAIRS];
+    for (int i = 0; i < ALIGNED_PAIRS; i++) {
+        aligned[i] = simple_aligned_alloc(64, 64);
+        small[i] = MALLOC(40);
+        ck_assert(aligned[i] != NULL && small[i] != NULL);
+        ck_assert(((uintptr_t)aligned[i] & 63) == 0);
+        for (int j = 0; j < 64; j += 2) {
+            aligned[i][j] = 6;     // The order of a 64-byte block
+            aligned[i][j + 1] = 1; // Free
+        }
+    }
+    for (int i = 0; i < ALIGNED_PAIRS; i++) {
+        FREE(small[i]);
+    }
+    for (int i = 0; i < ALIGNED_PAIRS; i++) {
+        FREE(aligned[i]);
+    }
+    FREE(page);
+
+    MMStats after = simple_mm_stats();
+    ck_assert_uint_eq(after.free_blocks, before.free_blocks);
+    ck_assert_uint_eq(after.largest_free, before.largest_free);
+    ck_assert_uint_eq(after.bytes_in_use, before.bytes_in_use);
+}
+END_TEST
+#endif
+#ifdef MM_BEST_FIT
+START_TEST(test_best_fit_placement)
+{
+    char *hole_small = MALLOC(1100);
+    char *guard1 = MALLOC(64);
+    char *hole_large = MALLOC(1500);
+    char *guard2 = MALLOC(64);
+
+    ck_assert(hole_small && guard1 && hole_large && guard2);
+
+    // Freed in this order, first fit would take the larger hole
+    FREE(hole_small);
+    FREE(hole_large);
+
+    char *block = MALLOC(1000);
+    ck_assert(block == hole_small);
+
+    FREE(block);
+    FREE(guard1);
+    FREE(guard2);
+}
+END_TEST
+
+START_TEST(test_best_fit_chain_takeover)
+{
+    enum { COUNT = 512 };
+    static char *first[COUNT], *second[COUNT], *guards[COUNT][3];
+
+    // Two blocks of every size, apart, each followed by a guard
+    for (int i = 0; i < COUNT; i++) {
+        first[i] = MALLOC(1024 + 16 * i);
+        guards[i][0] = MALLOC(300);
+        guards[i][1] = MALLOC(300);
+        second[i] = MALLOC(1024 + 16 * i);
+        guards[i][2] = MALLOC(300);
+        ck_assert(first[i] && second[i] && guards[i][0] && guards[i][1] && guards[i][2]);
+    }
+
+    // The second block chains behind the first, which then merges with its guard and leaves the tree
+    for (int i = 0; i < COUNT; i++) {
+        FREE(first[i]);
+        FREE(second[i]);
+    }
+    for (int i = 0; i < COUNT; i++) {
+        FREE(guards[i][0]);
+    }
+
+    // The chained blocks took over their nodes and are found again, in few steps; a segment
+    // tail of the same size may be taken instead now and then
+    static char *again[COUNT];
+    int found = 0;
+    MMStats before = simple_mm_stats();
+    for (int i = 0; i < COUNT; i++) {
+        again[i] = MALLOC(1024 + 16 * i);
+        ck_assert(again[i] != NULL);
+        found += again[i] == second[i];
+    }
+    MMStats after = simple_mm_stats();
+    ck_assert_int_ge(found, COUNT - 16);
+    size_t searches = after.searches - before.searches;
+    ck_assert(searches >= COUNT);
+    ck_assert((after.blocks_scanned - before.blocks_scanned) / searches < 40);
+
+    for (int i = 0; i < COUNT; i++) {
+        FREE(again[i]);
+        FREE(guards[i][1]);
+        FREE(guards[i][2]);
+    }
+}
+END_TEST
+#endif
+
+#ifndef MM_BACKEND_BUDDY
+/* Builds a list of count nodes in the attached heap and makes it the root */
+static void persist_list(int count) {
+    int **head = NULL;
+    for (int i = 0; i < count; i++) {
+        int **node = MALLOC(2 * sizeof(int *));
+        ck_assert(node != NULL);
+        node[0] = (int *)head;
+        node[1] = MALLOC(sizeof(int));
+        *node[1] = i;
+        head = node;
+    }
+    simple_mm_set_root(head);
+}
+
+/* Walks the root list, returning its length or -1 on a wrong value */
+static int persist_check(void) {
+    int n = 0;
+    for (int **node = simple_mm_root(); node != NULL; node = (int **)node[0], n++) {
+        if (node[1] == NULL) {
+            return -1;
+        }
+    }
+    int expected = n;
+    for (int **node = simple_mm_root(); node != NULL; node = (int **)node[0]) {
+        if (*node[1] != --expected) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+// Must run first: a heap file can only be attached before the anonymous arena exists
+START_TEST(test_persistent_heap)
+{
+    char path[] = "/tmp/mm_persist_XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    close(fd);
+
+    ck_assert_int_eq(simple_mm_attach(path, 4 * 1024 * 1024), MM_PERSIST_NEW);
+    ck_assert(simple_mm_attach(path, 0) == -1);  // Already attached
+    persist_list(1000);
+    MMStats saved = simple_mm_stats();
+    ck_assert(MALLOC(8 * 1024 * 1024) == NULL);  // The file does not grow
+    ck_assert_int_eq(simple_mm_detach(), 0);
+
+    // A clean detach reattaches in place with the saved index and counters
+    ck_assert_int_eq(simple_mm_attach(path, 0), MM_PERSIST_CLEAN);
+    ck_assert_int_eq(persist_check(), 1000);
+    MMStats reopened = simple_mm_stats();
+#ifndef MM_THREAD_SAFE
+    ck_assert(reopened.bytes_in_use == saved.bytes_in_use);  // Thread caches are flushed on detach
+    ck_assert(reopened.free_blocks == saved.free_blocks);
+#endif
+    ck_assert_int_eq(simple_mm_detach(), 0);
+
+    // A process that exits without detaching leaves the file dirty: the index is rebuilt
+    pid_t child = fork();
+    if (child == 0) {
+        if (simple_mm_attach(path, 0) != MM_PERSIST_CLEAN) {
+            _exit(1);
+        }
+        int **head = simple_mm_root();
+        FREE(head[1]);
+        head[1] = NULL;
+        simple_mm_set_root(head[0]);
+        FREE(head);
+        persist_list(10);
+        _exit(0);
+    }
+    int status;
+    ck_assert(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    ck_assert_int_eq(simple_mm_attach(path, 0), MM_PERSIST_REBUILT);
+    ck_assert_int_eq(persist_check(), 10);
+    MMStats rebuilt = simple_mm_stats();
+    ck_assert(rebuilt.bytes_in_use >= reopened.bytes_in_use + 9 * 2 * 24);  // Two 24-byte blocks per node
+#ifndef MM_THREAD_SAFE
+    ck_assert(rebuilt.bytes_in_use == reopened.bytes_in_use + 9 * 2 * 24);
+#endif
+    char *block = MALLOC(100);
+    ck_assert(block != NULL);
+    FREE(block);
+    ck_assert_int_eq(simple_mm_detach(), 0);
+    ck_assert_int_eq(simple_mm_detach(), -1);
+
+    unlink(path);
+}
+END_TEST
+#endif
+
+#if defined(MM_THREAD_SAFE) && !defined(MM_BACKEND_BUDDY)
+#define OWNED_BLOCKS 100
+
+static pthread_barrier_t owner_barrier;
+
+/* Allocates small blocks for test_persistent_owners, stamped with this thread's owner id */
+static void *thread_alloc_owned(void *arg)
+{
+    void **blocks = arg;
+    for (int i = 0; i < OWNED_BLOCKS; i++) {
+        blocks[i] = MALLOC(48);
+    }
+    return NULL;
+}
+
+/* Claims the owner id the first thread left behind and idles, never draining its remote stack */
+static void *thread_claim_owner(void *arg)
+{
+    FREE(MALLOC(48));
+    pthread_barrier_wait(&owner_barrier);
+    pthread_barrier_wait(&owner_barrier);
+    return NULL;
+}
+
+START_TEST(test_persistent_owners)
+{
+    char path[] = "/tmp/mm_owners_XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    close(fd);
+    ck_assert_int_eq(simple_mm_attach(path, 1024 * 1024), MM_PERSIST_NEW);
+
+    void *blocks[OWNED_BLOCKS];
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_alloc_owned, blocks);
+    pthread_join(thread, NULL);
+
+    // A fresh thread takes over the owner id, as a thread of the next process would
+    pthread_barrier_init(&owner_barrier, NULL, 2);
+    pthread_create(&thread, NULL, thread_claim_owner, NULL);
+    pthread_barrier_wait(&owner_barrier);
+    size_t held = simple_mm_stats().bytes_in_use;
+
+    // After a clean reattach the blocks are unowned and reach the arena through this thread's cache
+    ck_assert_int_eq(simple_mm_detach(), 0);
+    ck_assert_int_eq(simple_mm_attach(path, 0), MM_PERSIST_CLEAN);
+    for (int i = 0; i < OWNED_BLOCKS; i++) {
+        ck_assert(blocks[i] != NULL);
+        FREE(blocks[i]);
+    }
+    ck_assert_int_eq(simple_mm_detach(), 0);
+    ck_assert_int_eq(simple_mm_attach(path, 0), MM_PERSIST_CLEAN);
+    ck_assert(simple_mm_stats().bytes_in_use <= held - OWNED_BLOCKS * 48);
+
+    // The idle thread's cache still holds blocks of the heap, which it must drop on exit
+    ck_assert_int_eq(simple_mm_detach(), 0);
+    pthread_barrier_wait(&owner_barrier);
+    pthread_join(thread, NULL);
+    pthread_barrier_destroy(&owner_barrier);
+    unlink(path);
+}
+END_TEST
+
+/* Fills its cache and remote stack from the heap, then allocates again once main has detached it */
+static void *thread_outlive_heap(void *arg)
+{
+    void **owned = arg;
+    FREE(MALLOC(48));
+    *owned = MALLOC(48);
+    pthread_barrier_wait(&owner_barrier);
+    pthread_barrier_wait(&owner_barrier);
+
+    // Both the cache and the remote stack point into the unmapped file, so neither may be used
+    for (int i = 0; i < 4 * OWNED_BLOCKS; i++) {
+        char *block = MALLOC(48);
+        ck_assert(block != NULL);
+        memset(block, 0x5a, 48);
+        FREE(block);
+    }
+    return NULL;
+}
 
+START_TEST(test_persistent_detach_threads)
+{
+    char path[] = "/tmp/mm_outlive_XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    close(fd);
+    ck_assert_int_eq(simple_mm_attach(path, 1024 * 1024), MM_PERSIST_NEW);
+
+    void *owned = NULL;
+    pthread_t thread;
+    pthread_barrier_init(&owner_barrier, NULL, 2);
+    pthread_create(&thread, NULL, thread_outlive_heap, &owned);
+    pthread_barrier_wait(&owner_barrier);
+    FREE(owned);  // Lands on the thread's remote stack
+
+    ck_assert_int_eq(simple_mm_detach(), 0);
+    pthread_barrier_wait(&owner_barrier);
+    pthread_join(thread, NULL);
+    pthread_barrier_destroy(&owner_barrier);
+    unlink(path);
+}
+END_TEST
+#endif
 
+#ifndef MM_BACKEND_BUDDY
+START_TEST(test_fit_policies)
+{
+    char *hole_small = MALLOC(1100);
+    char *guard1 = MALLOC(300);  // Above the thread cache limit, so it sits between the holes
+    char *hole_large = MALLOC(1500);
+    char *guard2 = MALLOC(300);
+    ck_assert(hole_small && guard1 && hole_large && guard2);
+
+    // Both holes share a size class, the one freed last heads its list
+    FREE(hole_small);
+    FREE(hole_large);
+    MMStats before = simple_mm_stats();
+    char *block;
+
+#ifndef MM_BEST_FIT
+    int previous = simple_mm_set_fit_policy(MM_FIT_FIRST);
+    ck_assert(previous >= 0);
+    block = MALLOC(1000);
+    ck_assert(block == hole_large);
+    FREE(block);
+    ck_assert_int_eq(simple_mm_set_fit_policy(MM_FIT_BEST), MM_FIT_FIRST);
+#else
+    int previous = simple_mm_set_fit_policy(MM_FIT_BEST);
+    ck_assert_int_eq(simple_mm_set_fit_policy(MM_FIT_NEXT), -1);
+#endif
+    block = MALLOC(1000);
+    ck_assert(block == hole_small);
+    FREE(block);
+
+#ifndef MM_BEST_FIT
+    // Next fit moves on past the block it handed out, even once that is free again
+    simple_mm_set_fit_policy(MM_FIT_NEXT);
+    block = MALLOC(1000);
+    FREE(block);
+    char *next = MALLOC(1000);
+    ck_assert(next != NULL && next != block);
+    FREE(next);
+#endif
+
+    MMStats after = simple_mm_stats();
+    ck_assert(after.searches > before.searches);
+    ck_assert(after.blocks_scanned > before.blocks_scanned);
+    simple_mm_set_fit_policy(previous);
+
+    FREE(guard1);
+    FREE(guard2);
+}
+END_TEST
+#endif
+
+START_TEST(test_arena_growth)
+{
+    // Each request is larger than the default first segment, so each maps a new one
+    simple_mm_set_mmap_threshold(0);
+    char *blocks[3];
+    for (int i = 0; i < 3; i++) {
+        blocks[i] = MALLOC(3 * 1024 * 1024);
+        ck_assert(blocks[i] != NULL);
+        memset(blocks[i], i + 1, 3 * 1024 * 1024);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        ck_assert(blocks[i][0] == i + 1 && blocks[i][3 * 1024 * 1024 - 1] == i + 1);
+        FREE(blocks[i]);
+    }
+
+    simple_mm_set_mmap_threshold(128 * 1024);
+
+    // A first segment already exists, so explicit initialisation is refused
+    ck_assert(simple_mm_init(0) == -1);
+}
+END_TEST
+
+#ifndef MM_BACKEND_BUDDY
+START_TEST(test_direct_mapping)
+{
+    const size_t size = 1024 * 1024;
+    simple_mm_set_mmap_threshold(256 * 1024);
+    MMStats before = simple_mm_stats();
+
+    // A request above the threshold is mapped on its own and leaves the arena alone
+    char *block = MALLOC(size);
+    ck_assert(block != NULL);
+    memset(block, 0x5a, size);
+
+    MMStats during = simple_mm_stats();
+    ck_assert(during.bytes_mapped >= before.bytes_mapped + size);
+    ck_assert(during.allocated_blocks == before.allocated_blocks + 1);
+    ck_assert(during.bytes_free == before.bytes_free);
+
+    // Growing moves it to a larger mapping with its contents
+    char *grown = simple_realloc(block, 2 * size);
+    ck_assert(grown != NULL);
+    ck_assert(grown[0] == 0x5a && grown[size - 1] == 0x5a);
+
+    // Freeing unmaps it again
+    FREE(grown);
+    MMStats after = simple_mm_stats();
+    ck_assert(after.bytes_mapped == before.bytes_mapped);
+    ck_assert(after.allocated_blocks == before.allocated_blocks);
+
+    simple_mm_set_mmap_threshold(128 * 1024);
+}
+END_TEST
+
+START_TEST(test_trim_release)
+{
+    const size_t size = 512 * 1024;
+    simple_mm_set_mmap_threshold(0);
+    simple_mm_set_trim(64 * 1024, 0);
+
+    char *block = MALLOC(size);
+    ck_assert(block != NULL);
+    memset(block, 0x5a, size);
+
+    // A page in the middle of the block is resident while the block is in use
+    unsigned char resident;
+    void *page = (void *)(((uintptr_t)block + size / 2) & ~(uintptr_t)4095);
+    ck_assert(mincore(page, 4096, &resident) == 0 && (resident & 1));
+
+    // With no decay delay the free itself hands the block's pages back
+    FREE(block);
+    ck_assert(mincore(page, 4096, &resident) == 0 && !(resident & 1));
+    ck_assert(simple_mm_trim() == 0);
+
+    // With a delay the pages stay until an allocation past the deadline reaches the arena
+    simple_mm_set_trim(64 * 1024, 20);
+    block = MALLOC(size);
+    ck_assert(block != NULL);
+    memset(block, 0x5a, size);
+    page = (void *)(((uintptr_t)block + size / 2) & ~(uintptr_t)4095);
+    FREE(block);
+    ck_assert(mincore(page, 4096, &resident) == 0 && (resident & 1));
+    usleep(30 * 1000);
+    char *other = MALLOC(300);  // Above the thread cache limit
+    ck_assert(other != NULL);
+    ck_assert(mincore(page, 4096, &resident) == 0 && !(resident & 1));
+    FREE(other);
+
+    simple_mm_set_trim(128 * 1024, 1000);
+    simple_mm_set_mmap_threshold(128 * 1024);
+}
+END_TEST
+#endif
+
+START_TEST(test_stats_tracking)
+{
+    MMStats before = simple_mm_stats();
+
+    char *block1 = MALLOC(5000);
+    char *block2 = MALLOC(5000);
+    ck_assert(block1 != NULL && block2 != NULL);
+
+    MMStats during = simple_mm_stats();
+    ck_assert(during.bytes_in_use >= before.bytes_in_use + 10000);
+    ck_assert(during.allocated_blocks == before.allocated_blocks + 2);
+    ck_assert(during.largest_free <= during.bytes_free);
+    ck_assert(during.bytes_in_use + during.bytes_free < during.bytes_mapped);
+
+    FREE(block1);
+    FREE(block2);
+
+    MMStats after = simple_mm_stats();
+    ck_assert(after.bytes_in_use == before.bytes_in_use);
+    ck_assert(after.allocated_blocks == before.allocated_blocks);
+    ck_assert(after.fragmentation >= 0.0 && after.fragmentation < 1.0);
+}
+END_TEST
+
+START_TEST(test_realloc_in_place)
+{
+    char *block = MALLOC(3000);
+    ck_assert(block != NULL);
+    memset(block, 0x5a, 3000);
+
+    // Shrinking never moves the block, it frees the tail
+    char *shrunk = simple_realloc(block, 600);
+    ck_assert(shrunk == block);
+
+    // The freed tail is the free successor, so growing again stays in place
+    char *grown = simple_realloc(shrunk, 1800);
+    ck_assert(grown == block);
+    for (int i = 0; i < 600; i++) {
+        ck_assert(grown[i] == 0x5a);
+    }
+
+    FREE(grown);
+}
+END_TEST
+
+START_TEST(test_realloc_copy)
+{
+    int *block1 = MALLOC(300 * sizeof(int));
+    int *guard = MALLOC(300 * sizeof(int));
+
+    ck_assert(block1 != NULL && guard != NULL);
+    for (int i = 0; i < 300; i++) {
+        block1[i] = i;
+    }
+
+    // The live neighbour forces a move, which must keep the contents
+    int *moved = simple_realloc(block1, 3000 * sizeof(int));
+    ck_assert(moved != NULL && moved != block1);
+    for (int i = 0; i < 300; i++) {
+        ck_assert(moved[i] == i);
+    }
+
+    FREE(moved);
+    FREE(guard);
+}
+END_TEST
+
+START_TEST(test_aligned_allocation)
+{
+    char *line = simple_aligned_alloc(64, 100);
+    char *page = simple_aligned_alloc(4096, 5000);
+
+    ck_assert(line != NULL && page != NULL);
+    ck_assert(((uintptr_t) line & 63) == 0);
+    ck_assert(((uintptr_t) page & 4095) == 0);
+    ck_assert(line + 100 <= page || page + 5000 <= line);
+
+    memset(line, 0x11, 100);
+    memset(page, 0x22, 5000);
+    ck_assert(line[99] == 0x11);
+
+    ck_assert(simple_aligned_alloc(48, 16) == NULL);  // Not a power of two
+
+    FREE(line);
+    FREE(page);
+}
+END_TEST
+
+START_TEST(test_usable_size)
+{
+    // The usable size covers the request, and all of it can be written
+    for (size_t size = 1; size < 3000; size = size * 3 + 1) {
+        char *block = MALLOC(size);
+        ck_assert(block != NULL);
+        size_t usable = simple_malloc_usable_size(block);
+        ck_assert(usable >= size);
+        memset(block, 0x7e, usable);
+        FREE(block);
+    }
+    ck_assert(simple_malloc_usable_size(NULL) == 0);
+}
+END_TEST
+
+START_TEST(test_calloc_zeroes)
+{
+    unsigned char *dirty = MALLOC(400);
+    ck_assert(dirty != NULL);
+    memset(dirty, 0xff, 400);
+    FREE(dirty);
+
+    unsigned char *clean = simple_calloc(100, 4);
+    ck_assert(clean != NULL);
+    for (int i = 0; i < 400; i++) {
+        ck_assert(clean[i] == 0);
+    }
+    FREE(clean);
+
+    ck_assert(simple_calloc(SIZE_MAX / 2, 4) == NULL);  // Overflowing request
+}
+END_TEST
+
+START_TEST(test_oversize_requests)
+{
+    // Rounding these up would wrap to a tiny block
+    ck_assert(simple_malloc(SIZE_MAX) == NULL);
+    ck_assert(simple_malloc(SIZE_MAX - 7) == NULL);
+    ck_assert(simple_calloc(1, SIZE_MAX - 7) == NULL);
+    ck_assert(simple_aligned_alloc(64, SIZE_MAX - 100) == NULL);
+    ck_assert(simple_aligned_alloc(4096, SIZE_MAX - 4096) == NULL);
+    ck_assert(simple_aligned_alloc((size_t)1 << 63, 64) == NULL);
+    ck_assert(simple_handle_alloc(SIZE_MAX) == NULL);
+    ck_assert(simple_handle_alloc(SIZE_MAX - 7) == NULL);
+
+    char *ptr = MALLOC(100);
+    ck_assert(ptr != NULL);
+    memset(ptr, 0x5a, 100);
+    ck_assert(simple_realloc(ptr, SIZE_MAX - 3) == NULL);
+    ck_assert(simple_realloc(ptr, SIZE_MAX - 7) == NULL);
+    for (int i = 0; i < 100; i++) {
+        ck_assert(ptr[i] == 0x5a);  // The old block survives a failed realloc
+    }
+    FREE(ptr);
+}
+END_TEST
+
+START_TEST(test_slab_cache)
+{
+    SlabCache *cache = slab_cache_create(sizeof(int));
+    int *objects[1500];
+
+    ck_assert(cache != NULL);
+
+    // Enough objects to span several slabs, packed 8 bytes apart within a slab
+    for (int i = 0; i < 1500; i++) {
+        objects[i] = slab_alloc(cache);
+        ck_assert(objects[i] != NULL);
+        *objects[i] = i;
+    }
+    ck_assert((char *) objects[1] - (char *) objects[0] == 8);
+
+    for (int i = 0; i < 1500; i += 2) {
+        slab_free(cache, objects[i]);
+    }
+    for (int i = 1; i < 1500; i += 2) {
+        ck_assert(*objects[i] == i);
+    }
+
+    // Released slots are reused before any new slab is taken
+    int *again = slab_alloc(cache);
+    int reused = 0;
+    for (int i = 0; i < 1500; i += 2) {
+        reused |= (again == objects[i]);
+    }
+    ck_assert(reused);
+
+    ck_assert(slab_cache_create(SLAB_SIZE) == NULL);
+    slab_cache_destroy(cache);
+}
+END_TEST
+
+START_TEST(test_pool)
+{
+    MMStats before = simple_mm_stats();
+    BlockPool *pool = pool_create(20);
+    int *blocks[5000];
+    ck_assert(pool != NULL);
+
+    // Enough blocks to need several chunks, 24 bytes apart within one
+    for (int i = 0; i < 5000; i++) {
+        blocks[i] = pool_alloc(pool);
+        ck_assert(blocks[i] != NULL && ((uintptr_t)blocks[i] & 7) == 0);
+        blocks[i][4] = i;
+    }
+    ck_assert((char *)blocks[1] - (char *)blocks[0] == 24);
+
+    for (int i = 0; i < 5000; i += 2) {
+        pool_free(pool, blocks[i]);
+    }
+    for (int i = 1; i < 5000; i += 2) {
+        ck_assert_int_eq(blocks[i][4], i);
+    }
+
+    // The free stack hands back the block released last
+    ck_assert(pool_alloc(pool) == blocks[4998]);
+
+    ck_assert(pool_create(POOL_CHUNK) == NULL);
+    pool_destroy(pool);
+    MMStats after = simple_mm_stats();
+    ck_assert(after.bytes_in_use <= before.bytes_in_use + 256);  // The pool header may stay in a thread cache
+}
+END_TEST
+
+START_TEST(test_region)
+{
+    MMStats before = simple_mm_stats();
+    Region *region = region_create(1024);
+    ck_assert(region != NULL);
+
+    // Consecutive small allocations are bumped out of the same chunk
+    char *first = region_alloc(region, 10);
+    char *second = region_alloc(region, 10);
+    ck_assert(first != NULL && second == first + 16);
+
+    // Enough objects to need several chunks, plus one too large for any of them
+    RegionMark mark = region_mark(region);
+    for (int i = 0; i < 1000; i++) {
+        int *object = region_alloc(region, 24);
+        ck_assert(object != NULL && ((uintptr_t)object & 7) == 0);
+        *object = i;
+    }
+    char *large = region_alloc(region, 100000);
+    ck_assert(large != NULL);
+    memset(large, 0x3c, 100000);
+
+    // Releasing to the mark rewinds the bump pointer
+    region_release(region, mark);
+    ck_assert(region_alloc(region, 10) == second + 16);
+
+    // After a reset the region keeps one chunk and starts carving it again
+    region_reset(region);
+    ck_assert(region_alloc(region, 8) != NULL);
+
+    region_destroy(region);
+    MMStats after = simple_mm_stats();
+    ck_assert(after.allocated_blocks == before.allocated_blocks);
+}
+END_TEST
+
+START_TEST(test_region_oversize)
+{
+    Region *region = region_create(1024);
+    ck_assert(region != NULL);
+
+    // Rounding these up, or adding a chunk header, would wrap to a tiny chunk
+    ck_assert(region_alloc(region, SIZE_MAX) == NULL);
+    ck_assert(region_alloc(region, SIZE_MAX - 7) == NULL);
+    ck_assert(region_alloc(region, SIZE_MAX - 16) == NULL);
+    ck_assert(region_create(SIZE_MAX - 3) == NULL);
+
+    // The region still works after the failures
+    char *ptr = region_alloc(region, 100);
+    ck_assert(ptr != NULL);
+    memset(ptr, 0x5a, 100);
+    region_destroy(region);
+}
+END_TEST
+
+START_TEST(test_handle_compaction)
+{
+    enum { COUNT = 256, SIZE = 4096 };
+    MMHandle *handles[COUNT];
+
+    // Fill the arena with handles, then free every other one so only small holes remain
+    for (int i = 0; i < COUNT; i++) {
+        handles[i] = simple_handle_alloc(SIZE);
+        ck_assert(handles[i] != NULL);
+        int *data = simple_handle_lock(handles[i]);
+        ck_assert(((uintptr_t)data & 7) == 0);
+        data[0] = data[SIZE / sizeof(int) - 1] = i;
+        simple_handle_unlock(handles[i]);
+    }
+    for (int i = 1; i < COUNT; i += 2) {
+        simple_handle_free(handles[i]);
+    }
+
+    // A locked handle stays where it is while the others slide down
+    MMStats before = simple_mm_stats();
+    MMHandle *pinned = handles[COUNT / 2];
+    void *pinned_data = simple_handle_lock(pinned);
+    size_t moved = simple_mm_compact();
+    ck_assert(simple_handle_lock(pinned) == pinned_data);
+    simple_handle_unlock(pinned);
+    simple_handle_unlock(pinned);
+
+#ifndef MM_BACKEND_BUDDY
+    // The holes before the pinned block now form one free block, and large requests fit without growth
+    MMStats after = simple_mm_stats();
+    ck_assert(moved > 0);
+    ck_assert(after.bytes_mapped == before.bytes_mapped);
+    ck_assert(after.free_blocks < before.free_blocks);
+    ck_assert(after.largest_free >= 16 * SIZE);
+    MMHandle *large = simple_handle_alloc(16 * SIZE);
+    ck_assert(large != NULL);
+    ck_assert(simple_mm_stats().bytes_mapped == before.bytes_mapped);
+    simple_handle_free(large);
+#endif
+
+    for (int i = 0; i < COUNT; i += 2) {
+        int *data = simple_handle_lock(handles[i]);
+        ck_assert_int_eq(data[0], i);
+        ck_assert_int_eq(data[SIZE / sizeof(int) - 1], i);
+        simple_handle_unlock(handles[i]);
+        simple_handle_free(handles[i]);
+    }
+}
+END_TEST
+
+START_TEST(test_heap_profile)
+{
+#ifdef MM_PROFILE
+    // Sample every allocation, then check the live bytes rise and fall with the blocks
+    FILE *report = tmpfile();
+    size_t live_before, live_during, live_after, total;
+    char *blocks[16];
+
+    simple_mm_set_profile_rate(1);
+    ck_assert(simple_mm_profile_dump(fileno(report)) >= 0);
+    for (int i = 0; i < 16; i++) {
+        blocks[i] = MALLOC(100);
+    }
+    ck_assert(simple_mm_profile_dump(fileno(report)) >= 1);
+    for (int i = 0; i < 16; i++) {
+        FREE(blocks[i]);
+    }
+    simple_mm_profile_dump(fileno(report));
+    simple_mm_set_profile_rate(512 * 1024);
+
+    // The first allocation of a thread only starts its countdown, so allow one unsampled block
+    char line[160];
+    int reports = 0;
+    rewind(report);
+    while (fgets(line, sizeof(line), report) != NULL) {
+        size_t *live = reports == 0 ? &live_before : reports == 1 ? &live_during : &live_after;
+        if (sscanf(line, "heap profile: %*d sites, %zu live bytes, %zu allocated bytes", live, &total) == 2) {
+            reports++;
+        }
+    }
+    fclose(report);
+    ck_assert_int_eq(reports, 3);
+    ck_assert(live_during >= live_before + 15 * 100);
+    ck_assert(live_after == live_before);
+#else
+    ck_assert_int_eq(simple_mm_profile_dump(2), 0);
+#endif
+}
+END_TEST
+
+START_TEST(test_trace_ring)
+{
+    MMTraceEvent events[4];
+    char *ptr = MALLOC(72);
+    ck_assert(ptr != NULL);
+    FREE(ptr);
+
+    size_t count = simple_mm_trace_snapshot(events, 4);
+#ifdef MM_TRACE
+    // The newest two events are the malloc and the free above
+    ck_assert(count == 4);
+    ck_assert(events[2].op == MM_TRACE_MALLOC || events[1].op == MM_TRACE_MALLOC);
+    ck_assert(events[3].op == MM_TRACE_FREE || events[3].op == MM_TRACE_COALESCE);
+    ck_assert(events[3].cycles >= events[0].cycles);
+#else
+    // Tracing is compiled out, so nothing is recorded
+    ck_assert(count == 0);
+#endif
+}
+END_TEST
+
+#ifdef MM_THREAD_SAFE
+#define THREAD_COUNT      4
+#define THREAD_ITERATIONS 20000
+
+/* Worker for test_threaded_allocation: churns small and large blocks and checks their contents */
+static void *thread_churn(void *arg)
+{
+    uintptr_t id = (uintptr_t) arg;
+    uint32_t *live[8] = { NULL };
+    uint32_t sizes[8];
+    int ok = 1;
+
+    for (uint32_t n = 0; n < THREAD_ITERATIONS; n++) {
+        int slot = n & 7;
+        if (live[slot] != NULL) {
+            for (uint32_t i = 0; i < sizes[slot] >> 2; i++) {
+                if (live[slot][i] != (uint32_t) (id ^ slot)) {
+                    ok = 0;
+                }
+            }
+            FREE(live[slot]);
+        }
+        sizes[slot] = 16 + ((n * 37 + id) % 600);
+        live[slot] = MALLOC(sizes[slot]);
+        if (live[slot] == NULL) {
+            return NULL;
+        }
+        for (uint32_t i = 0; i < sizes[slot] >> 2; i++) {
+            live[slot][i] = (uint32_t) (id ^ slot);
+        }
+    }
+    for (int slot = 0; slot < 8; slot++) {
+        FREE(live[slot]);
+    }
+    return ok ? arg : NULL;
+}
+
+START_TEST(test_threaded_allocation)
+{
+    pthread_t threads[THREAD_COUNT];
+
+    for (uintptr_t t = 0; t < THREAD_COUNT; t++) {
+        pthread_create(&threads[t], NULL, thread_churn, (void *) (t + 1));
+    }
+    for (uintptr_t t = 0; t < THREAD_COUNT; t++) {
+        void *result;
+        pthread_join(threads[t], &result);
+        ck_assert_msg(result == (void *) (t + 1), "Thread %d saw a failed or corrupted allocation", (int) t);
+    }
+}
+END_TEST
+
+#define POOL_ROUNDS 20000
+
+/* Worker for test_pool_threads: takes blocks, checks nobody else holds them and gives them back */
+static void *thread_pool_churn(void *arg)
+{
+    BlockPool *pool = ((void **) arg)[0];
+    uintptr_t id = (uintptr_t) ((void **) arg)[1];
+    uintptr_t *held[8];
+    int ok = 1;
+
+    for (int n = 0; n < POOL_ROUNDS; n++) {
+        for (int i = 0; i < 8; i++) {
+            held[i] = pool_alloc(pool);
+            if (held[i] == NULL) {
+                return NULL;
+            }
+            held[i][1] = id;
+        }
+        for (int i = 0; i < 8; i++) {
+            ok &= held[i][1] == id;
+            pool_free(pool, held[i]);
+        }
+    }
+    return ok ? arg : NULL;
+}
+
+START_TEST(test_pool_threads)
+{
+    BlockPool *pool = pool_create(16);
+    pthread_t threads[THREAD_COUNT];
+    void *args[THREAD_COUNT][2];
+
+    for (uintptr_t t = 0; t < THREAD_COUNT; t++) {
+        args[t][0] = pool;
+        args[t][1] = (void *) (t + 1);
+        pthread_create(&threads[t], NULL, thread_pool_churn, args[t]);
+    }
+    for (uintptr_t t = 0; t < THREAD_COUNT; t++) {
+        void *result;
+        pthread_join(threads[t], &result);
+        ck_assert_msg(result == args[t], "Thread %d shared a pool block with another thread", (int) t);
+    }
+    pool_destroy(pool);
+}
+END_TEST
+
+#define REMOTE_BLOCKS 64
+
+/* Consumer for test_remote_free: frees blocks another thread allocated */
+static void *thread_free_all(void *arg)
+{
+    void **blocks = arg;
+    for (int i = 0; i < REMOTE_BLOCKS; i++) {
+        FREE(blocks[i]);
+    }
+    return NULL;
+}
+
+START_TEST(test_remote_free)
+{
+    void *blocks[REMOTE_BLOCKS];
+    pthread_t consumer;
+
+    for (int i = 0; i < REMOTE_BLOCKS; i++) {
+        blocks[i] = MALLOC(72);
+        ck_assert(blocks[i] != NULL);
+    }
+
+    // The consumer hands every block back to this thread, which allocates them again
+    pthread_create(&consumer, NULL, thread_free_all, blocks);
+    pthread_join(consumer, NULL);
+
+    int reused = 0;
+    void *again[REMOTE_BLOCKS];
+    for (int i = 0; i < REMOTE_BLOCKS; i++) {
+        again[i] = MALLOC(72);
+        ck_assert(again[i] != NULL);
+        for (int j = 0; j < REMOTE_BLOCKS; j++) {
+            reused += again[i] == blocks[j];
+        }
+    }
+    ck_assert_int_ge(reused, REMOTE_BLOCKS / 2);
+
+    for (int i = 0; i < REMOTE_BLOCKS; i++) {
+        FREE(again[i]);
+    }
+}
+END_TEST
+#endif
 
 
 /**
@@ -396,12 +1453,57 @@ Suite* simple_malloc_suite()
   TCase *tc_core = tcase_create("Core tests");
   tcase_set_timeout(tc_core, 120);
 
+#ifndef MM_BACKEND_BUDDY
+  tcase_add_test(tc_core, test_persistent_heap);
+#ifdef MM_THREAD_SAFE
+  tcase_add_test(tc_core, test_persistent_owners);
+  tcase_add_test(tc_core, test_persistent_detach_threads);
+#endif
+#endif
   tcase_add_test (tc_core, test_simple_allocation);
   tcase_add_test (tc_core, test_simple_unique_addresses);
   tcase_add_test (tc_core, test_memory_exerciser);
   tcase_add_test(tc_core, test_allocation);
   tcase_add_test(tc_core, test_coalescing);
+#ifndef MM_BACKEND_BUDDY
   tcase_add_test(tc_core, test_next_fit_allocation);
+#endif
+  tcase_add_test(tc_core, test_free_list_reuse);
+#ifndef MM_BACKEND_BUDDY
+  tcase_add_test(tc_core, test_coalesce_with_previous);
+#else
+  tcase_add_test(tc_core, test_buddy_merge);
+  tcase_add_test(tc_core, test_buddy_aligned_natural);
+#endif
+#ifdef MM_BEST_FIT
+  tcase_add_test(tc_core, test_best_fit_placement);
+  tcase_add_test(tc_core, test_best_fit_chain_takeover);
+#endif
+  tcase_add_test(tc_core, test_arena_growth);
+#ifndef MM_BACKEND_BUDDY
+  tcase_add_test(tc_core, test_fit_policies);
+  tcase_add_test(tc_core, test_direct_mapping);
+  tcase_add_test(tc_core, test_trim_release);
+#endif
+  tcase_add_test(tc_core, test_stats_tracking);
+  tcase_add_test(tc_core, test_realloc_in_place);
+  tcase_add_test(tc_core, test_realloc_copy);
+  tcase_add_test(tc_core, test_aligned_allocation);
+  tcase_add_test(tc_core, test_usable_size);
+  tcase_add_test(tc_core, test_calloc_zeroes);
+  tcase_add_test(tc_core, test_oversize_requests);
+  tcase_add_test(tc_core, test_slab_cache);
+  tcase_add_test(tc_core, test_region);
+  tcase_add_test(tc_core, test_region_oversize);
+  tcase_add_test(tc_core, test_pool);
+  tcase_add_test(tc_core, test_handle_compaction);
+  tcase_add_test(tc_core, test_trace_ring);
+  tcase_add_test(tc_core, test_heap_profile);
+#ifdef MM_THREAD_SAFE
+  tcase_add_test(tc_core, test_threaded_allocation);
+  tcase_add_test(tc_core, test_remote_free);
+  tcase_add_test(tc_core, test_pool_threads);
+#endif
 
   suite_add_tcase(s, tc_core);
   return s;
@@ -0,0 +1,188 @@
+/**
+ * @file   check_shim.c
+ * @brief  Unit tests for the C library entry points of malloc_shim.c.
+ *
+ * Linked against the same objects as libsimple_malloc.so, so malloc, realloc
+ * and friends below are the shim's, as they are under LD_PRELOAD.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <check.h>
+
+#define FORK_ROUNDS 50
+
+static volatile size_t huge = SIZE_MAX;  // Hidden from the compiler's object size checks
+
+START_TEST(test_shim_malloc_oversize)
+{
+    errno = 0;
+    ck_assert(malloc(huge) == NULL);
+    ck_assert_int_eq(errno, ENOMEM);
+
+    errno = 0;
+    ck_assert(malloc(huge - 7) == NULL);
+    ck_assert_int_eq(errno, ENOMEM);
+
+    errno = 0;
+    ck_assert(calloc(1, huge) == NULL);
+    ck_assert_int_eq(errno, ENOMEM);
+}
+END_TEST
+
+START_TEST(test_shim_realloc_oversize)
+{
+    char *ptr = malloc(64);
+    ck_assert(ptr != NULL);
+    memset(ptr, 0x5a, 64);
+
+    errno = 0;
+    ck_assert(realloc(ptr, huge - 1) == NULL);
+    ck_assert_int_eq(errno, ENOMEM);
+    for (int i = 0; i < 64; i++) {
+        ck_assert(ptr[i] == 0x5a);  // The old block is still valid
+    }
+    free(ptr);
+
+    errno = 0;
+    ck_assert(realloc(NULL, huge) == NULL);
+    ck_assert_int_eq(errno, ENOMEM);
+}
+END_TEST
+
+START_TEST(test_shim_aligned_oversize)
+{
+    void *ptr = NULL;
+    ck_assert_int_eq(posix_memalign(&ptr, 64, huge - 100), ENOMEM);
+    ck_assert(ptr == NULL);
+    ck_assert_int_eq(posix_memalign(&ptr, 4096, huge), ENOMEM);
+
+    errno = 0;
+    ck_assert(aligned_alloc(64, huge - 100) == NULL);
+    ck_assert_int_eq(errno, ENOMEM);
+
+    errno = 0;
+    ck_assert(pvalloc(huge - 100) == NULL);  // Rounding up to a page would wrap to 0
+    ck_assert_int_eq(errno, ENOMEM);
+
+    ck_assert_int_eq(posix_memalign(&ptr, 64, 100), 0);
+    ck_assert((uintptr_t)ptr % 64 == 0);
+    free(ptr);
+}
+END_TEST
+
+START_TEST(test_shim_alignment)
+{
+    // Anything the compiler may keep in SSE registers needs max_align_t alignment
+    for (size_t n = 0; n <= 1024; n++) {
+        void *ptr = malloc(n);
+        ck_assert((uintptr_t)ptr % 16 == 0);
+        void *zeroed = calloc(1, n);
+        ck_assert((uintptr_t)zeroed % 16 == 0);
+        ptr = realloc(ptr, n * 3 + 1);
+        ck_assert((uintptr_t)ptr % 16 == 0);
+        free(zeroed);
+        free(ptr);
+    }
+
+    // Large requests get a mapping of their own
+    for (size_t n = 4096; n <= 4 * 1024 * 1024; n *= 2) {
+        void *ptr = malloc(n + 8);
+        ck_assert((uintptr_t)ptr % 16 == 0);
+        ptr = realloc(ptr, n / 2);
+        ck_assert((uintptr_t)ptr % 16 == 0);
+        free(ptr);
+    }
+}
+END_TEST
+
+static volatile int churn_running;
+
+/* Keeps the arena lock busy and feeds the main thread's remote stack while it forks */
+static void *churn(void *arg)
+{
+    void **shared = arg;
+    while (churn_running) {
+        void *large = malloc(2000);
+        free(large);
+        free(__atomic_exchange_n(shared, NULL, __ATOMIC_ACQ_REL));
+    }
+    return NULL;
+}
+
+START_TEST(test_shim_fork_while_locked)
+{
+    void *shared = NULL;
+    pthread_t thread;
+    churn_running = 1;
+    pthread_create(&thread, NULL, churn, &shared);
+
+    for (int i = 0; i < FORK_ROUNDS; i++) {
+        free(__atomic_exchange_n(&shared, malloc(48), __ATOMIC_ACQ_REL));
+
+        pid_t pid = fork();
+        ck_assert(pid >= 0);
+        if (pid == 0) {
+            // A child that inherited a held lock would hang here until the alarm
+            alarm(10);
+            void *small = malloc(48);
+            void *large = malloc(2000);
+            free(__atomic_exchange_n(&shared, NULL, __ATOMIC_ACQ_REL));
+            free(large);
+            free(small);
+            _exit(small != NULL && large != NULL ? 0 : 1);
+        }
+
+        int status;
+        ck_assert(waitpid(pid, &status, 0) == pid);
+        ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    churn_running = 0;
+    pthread_join(thread, NULL);
+    free(shared);
+}
+END_TEST
+
+
+/**
+ * @name   Shim test suite.
+ * @brief  Failures must look like the C library's: NULL with errno set, or an error code.
+ */
+Suite* malloc_shim_suite()
+{
+  Suite *s = suite_create("malloc_shim");
+
+  TCase *tc_core = tcase_create("Core tests");
+  tcase_set_timeout(tc_core, 120);
+
+  tcase_add_test(tc_core, test_shim_malloc_oversize);
+  tcase_add_test(tc_core, test_shim_realloc_oversize);
+  tcase_add_test(tc_core, test_shim_aligned_oversize);
+  tcase_add_test(tc_core, test_shim_alignment);
+  tcase_add_test(tc_core, test_shim_fork_while_locked);
+
+  suite_add_tcase(s, tc_core);
+  return s;
+}
+
+
+int main()
+{
+  int number_failed;
+  Suite *s = malloc_shim_suite();
+  SRunner *sr = srunner_create(s);
+  srunner_set_fork_status(sr, CK_NOFORK);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? 0 : 1;
+}
@@ -64,18 +64,15 @@ int main(){
 
         if (counter >= capacity) {
             int new_capacity = capacity * 2;
-            int *new_collection = (int *)simple_malloc(new_capacity * sizeof(int));
-           
+            // Grows in place when the block after the collection is free
+            int *new_collection = (int *)simple_realloc(collection, new_capacity * sizeof(int));
+
             if (new_collection == NULL) {
                 write_string("Memory reallocation failed\n");
                 simple_free(collection);
                 return 1;  // Exit if memory reallocation fails
             }
-            for (int i = 0; i < capacity; i++) {
-                new_collection[i] = collection[i];
-            }
-            simple_free(collection);            // Free the old memory
-            collection = new_collection; // Use the new collection
+            collection = new_collection; // Use the resized collection
             capacity = new_capacity;     // Update capacity
         }
 
@@ -0,0 +1,77 @@
+/**
+ * @file   malloc_shim.c
+ * @brief  Exports the C library allocation functions on top of simple_malloc.
+ *
+ * Built into libsimple_malloc.so together with the thread-safe allocator, so
+ * unmodified programs can run on it:
+ *
+ *   LD_PRELOAD=./libsimple_malloc.so ./program
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "mm.h"
+
+#define SHIM_PAGE_SIZE 4096
+
+/* The C library reports allocation failure through errno as well */
+static void *checked(void *ptr) {
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void *malloc(size_t size) {
+    return checked(simple_malloc(size));
+}
+
+void free(void *ptr) {
+    simple_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    return checked(simple_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *result = simple_realloc(ptr, size);
+    return ptr != NULL && size == 0 ? result : checked(result);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *ptr = simple_aligned_alloc(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return checked(simple_aligned_alloc(alignment, size));
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return checked(simple_aligned_alloc(alignment, size));
+}
+
+void *valloc(size_t size) {
+    return checked(simple_aligned_alloc(SHIM_PAGE_SIZE, size));
+}
+
+void *pvalloc(size_t size) {
+    if (size > SIZE_MAX - SHIM_PAGE_SIZE) {
+        return checked(NULL);  // Rounding up to a page would wrap
+    }
+    size_t rounded = (size + SHIM_PAGE_SIZE - 1) & ~(size_t)(SHIM_PAGE_SIZE - 1);
+    return checked(simple_aligned_alloc(SHIM_PAGE_SIZE, rounded ? rounded : SHIM_PAGE_SIZE));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return simple_malloc_usable_size(ptr);
+}
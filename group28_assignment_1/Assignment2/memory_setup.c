@@ -1,21 +1,125 @@
 /**
- * @file   mm.c
+ * @file   memory_setup.c
  * @Author 02335 team
  * @date   September, 2024
  * @brief  Memory management skeleton.
- * 
-* This file contains low level initialization of memory. You should
- * not need to edit this file as part of the assignment.
+ *
+ * This file contains low level initialization of memory. The arena is no
+ * longer one static array: mm.c asks for segments on demand and each one
+ * is an anonymous private mapping, optionally backed by huge pages. A
+ * persistent heap is instead a shared mapping of a file.
  *
  */
 
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "mm.h"
 
-#define ALLOCATE_SIZE    32*1024*1024                 // 32 MB
-#define SKEW_SIZE        10
+#define SMALL_PAGE_SIZE  4096
+#define HUGE_PAGE_SIZE   (2 * 1024 * 1024)
+
+static int page_mode = -1;      // -1 until read from MM_HUGE_PAGES
+
+/* Page backing asked for by MM_HUGE_PAGES ("thp" or "explicit"), small pages otherwise */
+static int configured_page_mode() {
+    if (page_mode < 0) {
+        const char *text = getenv("MM_HUGE_PAGES");
+        page_mode = MM_PAGES_SMALL;
+        if (text != NULL && strcmp(text, "thp") == 0) {
+            page_mode = MM_PAGES_TRANSPARENT;
+        } else if (text != NULL && strcmp(text, "explicit") == 0) {
+            page_mode = MM_PAGES_EXPLICIT;
+        }
+    }
+    return page_mode;
+}
+
+void memory_set_page_mode(int mode) {
+    page_mode = mode;
+}
+
+size_t memory_segment_granularity() {
+    return configured_page_mode() == MM_PAGES_SMALL ? SMALL_PAGE_SIZE : HUGE_PAGE_SIZE;
+}
+
+/* Maps size bytes aligned to a huge page and asks the kernel to back them with huge pages */
+static void *map_transparent(size_t size) {
+    char *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    char *start = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (start > raw) {
+        munmap(raw, start - raw);
+    }
+    munmap(start + size, raw + HUGE_PAGE_SIZE - start);
+    madvise(start, size, MADV_HUGEPAGE);  // Without THP support this fails and small pages remain
+    return start;
+}
+
+void *memory_map_segment(size_t size) {
+    // Huge pages only back whole multiples of their size; anything else keeps small pages
+    int mode = size % HUGE_PAGE_SIZE == 0 ? configured_page_mode() : MM_PAGES_SMALL;
+
+    if (mode == MM_PAGES_EXPLICIT) {
+        void *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (segment != MAP_FAILED) {
+            return segment;
+        }
+        mode = MM_PAGES_TRANSPARENT;  // No reserved huge pages left: fall back to THP
+    }
+    if (mode == MM_PAGES_TRANSPARENT) {
+        void *segment = map_transparent(size);
+        if (segment != NULL) {
+            return segment;
+        }
+    }
+
+    void *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return segment == MAP_FAILED ? NULL : segment;
+}
+
+void memory_unmap_segment(void *segment, size_t size) {
+    munmap(segment, size);
+}
+
+void memory_release_pages(void *start, size_t size) {
+    madvise(start, size, MADV_DONTNEED);
+}
+
+void *memory_map_file(const char *path, size_t size, void *base, size_t *length) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
 
-static int8_t skew[SKEW_SIZE];                        // Misalignment
-static int8_t memory[ALLOCATE_SIZE];
+    // An existing file keeps its size, a new one is extended to size bytes of zeros
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size == 0 && (size == 0 || ftruncate(fd, size) < 0))) {
+        close(fd);
+        return NULL;
+    }
+    size_t file_size = st.st_size != 0 ? (size_t)st.st_size : size;
 
-const uintptr_t memory_start =  (uintptr_t) memory;
-const uintptr_t memory_end   =  (uintptr_t) memory + ALLOCATE_SIZE;
+    void *mapping = MAP_FAILED;
+    if (base != NULL) {
+        mapping = mmap(base, file_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    }
+    if (mapping == MAP_FAILED) {
+        mapping = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);  // The base is taken
+    }
+    close(fd);  // The mapping keeps the file open
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    *length = file_size;
+    return mapping;
+}
@@ -1,114 +1,1051 @@
+#define _DEFAULT_SOURCE
+
 #include <stdint.h>
-#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "mm.h"
 
+#ifdef MM_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#if defined(MM_TRACE) || defined(MM_PROFILE)
+#include <unistd.h>
+#endif
+
+#ifdef MM_PROFILE
+#include <signal.h>
+#endif
+
+/*
+ * A block header is a single word: the user size of the block, 8 more than a
+ * multiple of 16 so every header is followed by a 16-byte aligned user area,
+ * with flags in the low bits, bit 46 set on handle blocks the compactor may move,
+ * bit 47 set on blocks sampled by the heap profiler and the owning thread cache
+ * in the top 16 bits.
+ * The next block starts right after the user area.
+ */
 typedef struct header {
-    struct header *next;     // Bit 0 is used to indicate free block 
-    uint64_t user_block;  // Empty array to ensure user block is aligned
+    size_t size;             // Bit 0 marks this block free, bit 1 the previous block, bit 2 a direct mapping
 } BlockHeader;
 
-/* Macros to handle the free flag and next pointer */
-#define GET_NEXT(p)    (BlockHeader *)((uintptr_t)(p->next) & ~0x1)
-#define SET_NEXT(p, n) p->next = (BlockHeader *)(((uintptr_t)n & ~0x1) | ((uintptr_t)p->next & 0x1))
-#define GET_FREE(p)    (uint8_t)((uintptr_t)(p->next) & 0x1)
-#define SET_FREE(p, f) p->next = (BlockHeader *)(((uintptr_t)p->next & ~0x1) | (f & 0x1))
-#define SIZE(p)        ((uintptr_t)(GET_NEXT(p)) - (uintptr_t)(p) - sizeof(BlockHeader))
+/* Links kept in the user area of a free block while it sits in a free list */
+typedef struct free_links {
+    BlockHeader *next_free;
+    BlockHeader *prev_free;
+} FreeLinks;
+
+/* Macros to handle the free flags, the size and the next block */
+#define FLAG_BITS      0x7
+#define OWNER_SHIFT    48
+#define OWNER_BITS     (~(size_t)0 << OWNER_SHIFT)
+#define SAMPLED        ((size_t)1 << 47)
+#define MOVABLE        ((size_t)1 << 46)
+#define SIZE_BITS      ((MOVABLE - 1) & ~(size_t)FLAG_BITS)
+#define GET_OWNER(h)   ((unsigned)((h) >> OWNER_SHIFT))  // From a header word, 0 for no owner
+#define SIZE(p)        ((p)->size & SIZE_BITS)
+#define SET_SIZE(p, s) (p)->size = (s) | ((p)->size & (FLAG_BITS | SAMPLED | MOVABLE))
+#define GET_NEXT(p)    ((BlockHeader *)((uintptr_t)((p) + 1) + SIZE(p)))
+#define SET_NEXT(p, n) SET_SIZE(p, (uintptr_t)(n) - (uintptr_t)((p) + 1))
+#define GET_FREE(p)    (uint8_t)((p)->size & 0x1)
+#define SET_FREE(p, f) (p)->size = ((p)->size & ~(size_t)0x1) | ((f) & 0x1)
+#define GET_PREV_FREE(p)    (uint8_t)(((p)->size >> 1) & 0x1)
+#define SET_PREV_FREE(p, f) __atomic_store_n(&(p)->size, ((p)->size & ~(size_t)0x2) | (((f) & 0x1) << 1), __ATOMIC_RELAXED)
+
+/* Header of an allocated block read without the arena lock, which may be flipping its previous-free bit */
+#define LOAD_HEADER(p) __atomic_load_n(&(p)->size, __ATOMIC_RELAXED)
+#define MMAPPED        0x4            // The block is a mapping of its own, outside every segment
+#define LINKS(p)       ((FreeLinks *)((BlockHeader *)(p) + 1))
+
+#ifdef MM_BEST_FIT
+/* Best fit: large free blocks sit in a treap keyed on size, behind their list links */
+typedef struct tree_links {
+    BlockHeader *left;
+    BlockHeader *right;
+} TreeLinks;
+
+#define TREE(p)        ((TreeLinks *)(LINKS(p) + 1))
+#define PRIORITY(p)    (((uintptr_t)(p) * 0x9E3779B97F4A7C15ull) >> 32)  // Heap order from the address
+#define FREE_META      (sizeof(FreeLinks) + sizeof(TreeLinks))
+#else
+#define FREE_META      sizeof(FreeLinks)
+#endif
 
-#define MIN_SIZE       (8)
+/* Size a large free block had when its pages were last released, kept behind its links */
+#define RELEASED(p)    (*(size_t *)((uintptr_t)LINKS(p) + FREE_META))
+
+/* Boundary tags: the last word of a free block points back to its header */
+#define FOOTER(p)      (*(BlockHeader **)((uintptr_t)GET_NEXT(p) - sizeof(BlockHeader *)))
+#define PREV_FOOTER(p) (*(BlockHeader **)((uintptr_t)(p) - sizeof(BlockHeader *)))
+
+#define MIN_SIZE       (sizeof(FreeLinks) + sizeof(BlockHeader *))   // Links plus footer
+#define MAX_REQUEST    SIZE_BITS      // Largest size a header can hold; larger requests fail before rounding
+
+/* Arena segments: each mapping starts with a Segment and ends with a dummy block */
+typedef struct segment {
+    struct segment *next;    // Next segment, newest first
+    size_t size;             // Bytes mapped, including this header
+    size_t reserved;         // Puts the first header 8 bytes short of a 16-byte boundary
+} Segment;
+
+#define SEG_FIRST(s)   ((BlockHeader *)((Segment *)(s) + 1))
+#define SEG_DUMMY(s)   ((BlockHeader *)((uintptr_t)(s) + (s)->size) - 1)
+
+#define PAGE_SIZE            4096
+#define ARENA_DEFAULT_SIZE   (1024 * 1024)          // First segment unless configured otherwise
+#define SEGMENT_GROWTH_MAX   (64 * 1024 * 1024)     // Largest segment mapped just for growth
+#define MMAP_THRESHOLD_DEFAULT (128 * 1024)         // Requests from here on get their own mapping
+#define TRIM_THRESHOLD_DEFAULT (128 * 1024)         // Free blocks from here on give their pages back
+#define TRIM_DECAY_DEFAULT     1000                 // Milliseconds a large free block stays resident
+
+/* Size classes: exact 8-byte steps below SMALL_LIMIT, powers of two above */
+#define SMALL_LIMIT    512
+#define NUM_SMALL      (SMALL_LIMIT >> 3)
+#define NUM_CLASSES    128
+#define MAP_WORDS      (NUM_CLASSES / 64)
 
 void split_block(BlockHeader *block, size_t size);
 void coalesce(BlockHeader *block);
-void coalesce_all_blocks();  // New function for memory defragmentation
+static size_t compact_all();
 
-static BlockHeader *first = NULL;
-static BlockHeader *current = NULL;
+#ifdef MM_TRACE
+/* Trace ring: the newest MM_TRACE_CAPACITY events, overwritten oldest first */
+#define MM_TRACE_CAPACITY  4096                 // Must be a power of two
 
-/* Initialize the memory block structure */
-void simple_init() {
-    uintptr_t aligned_memory_start = (memory_start + 7) & ~0x07;
-    uintptr_t aligned_memory_end = memory_end & ~0x07;
+static MMTraceEvent trace_ring[MM_TRACE_CAPACITY];
+static uint64_t trace_head;                     // Total number of events ever recorded
 
-    // Check if there is enough memory for at least one block and the dummy block
-    if (aligned_memory_start + 2 * sizeof(BlockHeader) + MIN_SIZE > aligned_memory_end) {
-        printf("Error: Not enough memory to initialize the block structure.\n");
-        first = NULL;  // Mark initialization failure
-        return;
+/* Reads the cycle counter, or a nanosecond clock where there is none */
+static inline uint64_t trace_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+/* Claims the next ring slot; concurrent writers never share a slot until the ring wraps */
+static void trace_record(uint32_t op, size_t size, const void *address) {
+    uint64_t slot = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED) & (MM_TRACE_CAPACITY - 1);
+    MMTraceEvent *event = &trace_ring[slot];
+    event->cycles = trace_cycles();
+    event->size = size;
+    event->address = (uintptr_t)address;
+    event->op = op;
+}
+
+#define TRACE_EVENT(op, size, address) trace_record(op, size, address)
+#else
+#define TRACE_EVENT(op, size, address)
+#endif
+
+#ifdef MM_THREAD_SAFE
+/* Thread cache: small freed blocks stay allocated in the arena and are kept per thread */
+#define TCACHE_LIMIT   256                      // Largest block size kept in a thread cache
+#define TCACHE_BINS    ((TCACHE_LIMIT >> 3) + 1)
+#define TCACHE_COUNT   32                       // Blocks a bin may hold before it is flushed
+#define TCACHE_BATCH   16                       // Blocks moved per refill or flush
+
+typedef struct thread_cache {
+    BlockHeader *bins[TCACHE_BINS];   // Singly linked through LINKS(b)->next_free
+    uint32_t counts[TCACHE_BINS];
+    uint16_t owner;                   // Id stamped on the blocks this cache hands out, 0 if none
+    uint8_t registered;               // Set once the exit destructor is armed
+    unsigned generation;              // Arena generation the cached blocks belong to
+} ThreadCache;
+
+/*
+ * Remote frees: a small block freed by a thread other than its owner is pushed
+ * onto the owner's lock-free stack and reclaimed by the owner in one exchange,
+ * so producer-consumer pipelines never meet on the arena lock.
+ */
+#define MAX_OWNERS     1024
+#define REMOTE_CLOSED  ((BlockHeader *)1)       // The owner has exited, blocks go to the arena
+
+static BlockHeader *remote_frees[MAX_OWNERS];  // Linked through LINKS(b)->next_free
+static uint8_t owner_used[MAX_OWNERS];         // Guarded by the arena lock
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local ThreadCache tcache;
+static unsigned arena_generation = 0;          // Bumped when a persistent heap is detached
+
+#define ARENA_LOCK()   pthread_mutex_lock(&arena_lock)
+#define ARENA_UNLOCK() pthread_mutex_unlock(&arena_lock)
+#else
+#define ARENA_LOCK()
+#define ARENA_UNLOCK()
+#endif
+
+#ifdef MM_PROFILE
+/* Heap profiler: about one sample per profile_rate bytes allocated, attributed to the caller */
+#ifdef MM_THREAD_SAFE
+static _Thread_local int64_t sample_countdown;  // Bytes left until this thread's next sample
+#else
+static int64_t sample_countdown;
+#endif
+
+static void profile_sample(void *ptr, size_t size, const void *site);
+static void profile_forget(void *ptr);
+
+#define PROFILE_ALLOC(ptr, size) \
+    do { \
+        if ((sample_countdown -= (int64_t)(size)) < 0) { \
+            profile_sample(ptr, size, __builtin_return_address(0)); \
+        } \
+    } while (0)
+#else
+#define PROFILE_ALLOC(ptr, size)
+#endif
+
+static Segment *segments = NULL;      // Every mapped segment, newest first
+static size_t arena_mapped = 0;       // Total bytes over all segments
+
+/* Counters behind simple_mm_stats, kept up to date by every split, merge and index change */
+static size_t stat_usable = 0;        // Bytes available to blocks, headers included
+static size_t stat_blocks = 0;        // Blocks of all kinds, dummies excluded
+static size_t stat_free_blocks = 0;
+static size_t stat_free_bytes = 0;    // User bytes of free blocks
+
+/* Direct mappings live outside the arena lock, so their counters are updated atomically */
+static size_t mmap_threshold = 0;     // 0 until read from MM_MMAP_THRESHOLD, SIZE_MAX when disabled
+static size_t stat_direct_blocks = 0;
+static size_t stat_direct_bytes = 0;  // Bytes mapped for direct blocks, headers included
+
+/* Page release, guarded by the arena lock */
+static size_t trim_threshold = 0;     // 0 until read from MM_TRIM_THRESHOLD, SIZE_MAX when disabled
+static uint64_t trim_decay_ns = 0;
+static uint64_t trim_due = 0;         // When the pending release may run, 0 if none is pending
+
+static BlockHeader *free_lists[NUM_CLASSES];  // Head of the free list for each size class
+static uint64_t class_map[MAP_WORDS];          // Bit set when the matching free list is non-empty
+static BlockHeader *rovers[NUM_CLASSES];       // Next fit: where the next scan of a large class starts
+
+/* Placement, guarded by the arena lock */
+static int fit_policy = -1;           // -1 until read from MM_POLICY
+static size_t stat_searches = 0;      // Lookups in the free index
+static size_t stat_scanned = 0;       // Free blocks examined by those lookups
+
+static size_t movable_blocks = 0;     // Live handle blocks; without any the compactor has nothing to do
+
+typedef struct persist_header PersistHeader;
+static PersistHeader *persist = NULL; // Attached persistent heap, NULL while the arena is anonymous
+
+#ifdef MM_BEST_FIT
+static BlockHeader *size_tree = NULL;          // Root of the treap holding large free blocks
+#endif
+
+/* Maps a block size to the index of its free list */
+static int size_class(size_t size) {
+    if (size < SMALL_LIMIT) {
+        return (int)(size >> 3);
     }
+    int cls = NUM_SMALL + (63 - __builtin_clzll(size)) - 9;  // 512 -> first large class
+    return cls < NUM_CLASSES ? cls : NUM_CLASSES - 1;
+}
 
-    first = (BlockHeader *)aligned_memory_start;
-    SET_NEXT(first, (BlockHeader *)(aligned_memory_end - sizeof(BlockHeader)));
-    SET_FREE(first, 1);
+/* Returns the first non-empty class at or above cls, or -1 if there is none */
+static int next_nonempty_class(int cls) {
+    for (int w = cls / 64; w < MAP_WORDS; w++) {
+        uint64_t bits = class_map[w];
+        if (w == cls / 64) {
+            bits &= ~0ULL << (cls % 64);
+        }
+        if (bits) {
+            return w * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
 
-    BlockHeader *dummy = (BlockHeader *)(aligned_memory_end - sizeof(BlockHeader));
-    SET_NEXT(dummy, first);
-    SET_FREE(dummy, 0);
+/* Pushes a free block onto the front of its size class list */
+static void list_insert(BlockHeader *block) {
+    int cls = size_class(SIZE(block));
+    BlockHeader *head = free_lists[cls];
 
-    current = first;
+    LINKS(block)->next_free = head;
+    LINKS(block)->prev_free = NULL;
+    if (head) {
+        LINKS(head)->prev_free = block;
+    }
+    free_lists[cls] = block;
+    class_map[cls / 64] |= 1ULL << (cls % 64);
 }
 
-/* Allocates a block of memory */
-void* simple_malloc(size_t size) {
-    printf("Requesting allocation of size: %zu\n", size);
+/* Unlinks a free block from its size class list */
+static void list_remove(BlockHeader *block) {
+    int cls = size_class(SIZE(block));
+    BlockHeader *next = LINKS(block)->next_free;
+    BlockHeader *prev = LINKS(block)->prev_free;
 
-    if (first == NULL) {
-        simple_init();
-        if (first == NULL) {
-            printf("Memory initialization failed! Not enough memory to set up the block structure.\n");
-            return NULL;
+    if (prev) {
+        LINKS(prev)->next_free = next;
+    } else {
+        free_lists[cls] = next;
+        if (!next) {
+            class_map[cls / 64] &= ~(1ULL << (cls % 64));
         }
     }
+    if (next) {
+        LINKS(next)->prev_free = prev;
+    }
+    if (rovers[cls] == block) {
+        rovers[cls] = next;
+    }
+}
 
-    // Align the requested size to 8 bytes
-    size_t aligned_size = (size + 7) & ~0x07;
-    printf("Aligned size: %zu\n", aligned_size);
+/* Placement policy, from MM_POLICY ("first", "next" or "best") on first use */
+static int placement_policy() {
+    if (fit_policy < 0) {
+        const char *text = getenv("MM_POLICY");
+#ifdef MM_BEST_FIT
+        fit_policy = MM_FIT_BEST;  // Large blocks are indexed by size only
+#else
+        fit_policy = text == NULL ? MM_FIT_FIRST :
+                     strcmp(text, "next") == 0 ? MM_FIT_NEXT :
+                     strcmp(text, "best") == 0 ? MM_FIT_BEST : MM_FIT_FIRST;
+#endif
+    }
+    return fit_policy;
+}
 
-    BlockHeader *search_start = current;
-    int search_attempts = 0;  // Track the number of cycles through memory
+int simple_mm_set_fit_policy(int policy) {
+    ARENA_LOCK();
+    int previous = placement_policy();
+#ifdef MM_BEST_FIT
+    if (policy != MM_FIT_BEST) {
+#else
+    if (policy != MM_FIT_FIRST && policy != MM_FIT_NEXT && policy != MM_FIT_BEST) {
+#endif
+        previous = -1;
+    } else {
+        fit_policy = policy;
+    }
+    ARENA_UNLOCK();
+    return previous;
+}
 
-    while (search_attempts < 2) {  // Allow two full cycles through memory to avoid fragmentation
-        printf("Checking block at %p with size %zu, free status: %d\n", current, SIZE(current), GET_FREE(current));
+#ifndef MM_BEST_FIT
+/* Picks a block of at least size bytes from a large class under the placement policy */
+static BlockHeader *class_scan(int cls, size_t size) {
+    int policy = placement_policy();
+    BlockHeader *best = NULL;
 
-        if (GET_FREE(current) && SIZE(current) >= aligned_size) {
-            printf("Found a free block at %p of size %zu\n", current, SIZE(current));
+    if (policy == MM_FIT_NEXT) {
+        // Resume after the block this class handed out last, wrapping around once
+        BlockHeader *start = rovers[cls] ? rovers[cls] : free_lists[cls];
+        BlockHeader *b = start;
+        while (b != NULL) {
+            stat_scanned++;
+            if (SIZE(b) >= size) {
+                rovers[cls] = LINKS(b)->next_free;
+                return b;
+            }
+            b = LINKS(b)->next_free ? LINKS(b)->next_free : free_lists[cls];
+            if (b == start) {
+                break;
+            }
+        }
+        return NULL;
+    }
 
-            if (SIZE(current) == aligned_size) {
-                // Exact fit, no need to split
-                SET_FREE(current, 0);
-                BlockHeader *allocated_block = current;
-                current = GET_NEXT(current);
-                printf("Allocated exact-fit block at %p\n", allocated_block);
-                return (void *)(allocated_block + 1);
-            } else if (SIZE(current) - aligned_size >= sizeof(BlockHeader) + MIN_SIZE) {
-                // Split the block if remaining size is enough
-                printf("Splitting block at %p\n", current);
-                split_block(current, aligned_size);
+    for (BlockHeader *b = free_lists[cls]; b != NULL; b = LINKS(b)->next_free) {
+        stat_scanned++;
+        if (SIZE(b) >= size && (best == NULL || SIZE(b) < SIZE(best))) {
+            best = b;
+            if (policy == MM_FIT_FIRST || SIZE(b) == size) {
+                break;
             }
+        }
+    }
+    return best;
+}
+
+/* Searches the size class lists under the placement policy */
+static BlockHeader *list_find(size_t size) {
+    int cls = size_class(size);
+
+    if (cls >= NUM_SMALL) {
+        // Large classes span a range of sizes, so the own class needs a scan
+        BlockHeader *block = class_scan(cls, size);
+        if (block != NULL) {
+            return block;
+        }
+        cls++;
+    }
+
+    // Small classes hold exact sizes and every block in a higher class is big enough
+    cls = cls < NUM_CLASSES ? next_nonempty_class(cls) : -1;
+    if (cls < 0) {
+        return NULL;
+    }
+    if (cls >= NUM_SMALL && placement_policy() != MM_FIT_FIRST) {
+        return class_scan(cls, size);  // Still the smallest, or the next, of the class
+    }
+    stat_scanned++;
+    return free_lists[cls];
+}
+#endif
+
+#ifdef MM_BEST_FIT
+/*
+ * Treap of large free blocks. Each tree node is the first block of its size;
+ * further blocks of the same size hang off it on a chain through their list
+ * links. Tree nodes have prev_free == NULL, chained blocks never do.
+ */
+
+/* Adds a block under root and returns the new root of that subtree */
+static BlockHeader *tree_insert_at(BlockHeader *root, BlockHeader *block) {
+    if (root == NULL) {
+        return block;
+    }
+
+    if (SIZE(block) == SIZE(root)) {
+        // Same size: chain behind the tree node, the tree shape is unchanged
+        BlockHeader *next = LINKS(root)->next_free;
+        LINKS(block)->next_free = next;
+        LINKS(block)->prev_free = root;
+        if (next) {
+            LINKS(next)->prev_free = block;
+        }
+        LINKS(root)->next_free = block;
+    } else if (SIZE(block) < SIZE(root)) {
+        BlockHeader *child = tree_insert_at(TREE(root)->left, block);
+        TREE(root)->left = child;
+        if (PRIORITY(child) > PRIORITY(root)) {    // Rotate right
+            TREE(root)->left = TREE(child)->right;
+            TREE(child)->right = root;
+            return child;
+        }
+    } else {
+        BlockHeader *child = tree_insert_at(TREE(root)->right, block);
+        TREE(root)->right = child;
+        if (PRIORITY(child) > PRIORITY(root)) {    // Rotate left
+            TREE(root)->right = TREE(child)->left;
+            TREE(child)->left = root;
+            return child;
+        }
+    }
+    return root;
+}
+
+/* Joins two subtrees where every size in a is below every size in b */
+static BlockHeader *tree_merge(BlockHeader *a, BlockHeader *b) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+
+    if (PRIORITY(a) > PRIORITY(b)) {
+        TREE(a)->right = tree_merge(TREE(a)->right, b);
+        return a;
+    }
+    TREE(b)->left = tree_merge(a, TREE(b)->left);
+    return b;
+}
+
+static void tree_insert(BlockHeader *block) {
+    LINKS(block)->next_free = NULL;
+    LINKS(block)->prev_free = NULL;
+    TREE(block)->left = NULL;
+    TREE(block)->right = NULL;
+    size_tree = tree_insert_at(size_tree, block);
+}
+
+static void tree_remove(BlockHeader *block) {
+    BlockHeader *next = LINKS(block)->next_free;
+    BlockHeader *prev = LINKS(block)->prev_free;
+
+    if (prev != NULL) {
+        // A chained block unlinks in O(1)
+        LINKS(prev)->next_free = next;
+        if (next) {
+            LINKS(next)->prev_free = prev;
+        }
+        return;
+    }
+
+    // A tree node: find the link that points at it
+    BlockHeader **link = &size_tree;
+    while (*link != block) {
+        link = SIZE(block) < SIZE(*link) ? &TREE(*link)->left : &TREE(*link)->right;
+    }
+
+    *link = tree_merge(TREE(block)->left, TREE(block)->right);
+
+    // The next block of the same size becomes the node, placed by its own priority with its chain in tow
+    if (next != NULL) {
+        LINKS(next)->prev_free = NULL;
+        TREE(next)->left = NULL;
+        TREE(next)->right = NULL;
+        size_tree = tree_insert_at(size_tree, next);
+    }
+}
+
+/* Smallest free block of at least size bytes, preferring a chained one as it unlinks in O(1) */
+static BlockHeader *tree_find(size_t size) {
+    BlockHeader *best = NULL;
+
+    for (BlockHeader *node = size_tree; node != NULL; ) {
+        stat_scanned++;
+        if (SIZE(node) >= size) {
+            best = node;
+            if (SIZE(node) == size) {
+                break;
+            }
+            node = TREE(node)->left;
+        } else {
+            node = TREE(node)->right;
+        }
+    }
+
+    if (best != NULL && LINKS(best)->next_free != NULL) {
+        return LINKS(best)->next_free;
+    }
+    return best;
+}
+#endif
+
+/* Adds a free block to the index used by the placement policy */
+static void insert_free(BlockHeader *block) {
+    stat_free_blocks++;
+    stat_free_bytes += SIZE(block);
+#ifdef MM_BEST_FIT
+    if (SIZE(block) >= SMALL_LIMIT) {
+        tree_insert(block);
+        return;
+    }
+#endif
+    list_insert(block);
+}
+
+/* Takes a free block out of the index */
+static void remove_free(BlockHeader *block) {
+    stat_free_blocks--;
+    stat_free_bytes -= SIZE(block);
+#ifdef MM_BEST_FIT
+    if (SIZE(block) >= SMALL_LIMIT) {
+        tree_remove(block);
+        return;
+    }
+#endif
+    list_remove(block);
+}
+
+/* Finds a free block of at least size bytes, or NULL if there is none */
+static BlockHeader *find_fit(size_t size) {
+    stat_searches++;
+#ifdef MM_BEST_FIT
+    // Small classes hold exact sizes, so the first non-empty one at or above size fits best
+    if (size < SMALL_LIMIT) {
+        int cls = next_nonempty_class(size_class(size));
+        if (cls >= 0) {
+            stat_scanned++;
+            return free_lists[cls];
+        }
+    }
+    return tree_find(size);
+#else
+    return list_find(size);
+#endif
+}
+
+/* Rounds a request up so the next header keeps its user area 16-byte aligned, and to at least the room a free block needs */
+static size_t align_request(size_t size) {
+    size_t aligned_size = ((size + sizeof(BlockHeader) + 15) & ~(size_t)15) - sizeof(BlockHeader);
+    return aligned_size < MIN_SIZE ? MIN_SIZE : aligned_size;
+}
+
+/* Turns size bytes at seg into a segment holding one free block and adds it to the arena */
+static void format_segment(Segment *seg, size_t size) {
+    seg->size = size;
+    seg->next = segments;
+    segments = seg;
+    arena_mapped += size;
+    stat_usable += size - sizeof(Segment) - sizeof(BlockHeader);
+    stat_blocks++;
+
+    BlockHeader *block = SEG_FIRST(seg);
+    BlockHeader *dummy = SEG_DUMMY(seg);
+    block->size = (uintptr_t)dummy - (uintptr_t)(block + 1);
+    SET_FREE(block, 1);
+
+    // The dummy is never free and has size 0, so nothing coalesces past the segment end
+    dummy->size = 0;
+    SET_PREV_FREE(dummy, 1);
+
+    FOOTER(block) = block;
+    RELEASED(block) = SIZE(block);  // Fresh pages are not resident yet
+    insert_free(block);
+}
+
+/* Maps a segment of at least size bytes and adds its single free block to the index */
+static Segment *add_segment(size_t size) {
+    size_t granularity = memory_segment_granularity();
+    size = (size + granularity - 1) & ~(granularity - 1);
+
+    Segment *seg = memory_map_segment(size);
+    if (seg == NULL) {
+        TRACE_EVENT(MM_TRACE_FAIL, size, NULL);
+        return NULL;
+    }
+    format_segment(seg, size);
+    return seg;
+}
+
+/* Parses a byte count with an optional K, M or G suffix */
+static size_t parse_size(const char *text) {
+    char *end;
+    size_t size = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'G': case 'g': size <<= 10;  // Fall through
+        case 'M': case 'm': size <<= 10;  // Fall through
+        case 'K': case 'k': size <<= 10;
+    }
+    return size;
+}
+
+/* Sizes the first segment from MM_ARENA_SIZE */
+static size_t configured_arena_size() {
+    const char *text = getenv("MM_ARENA_SIZE");
+    size_t size = text != NULL ? parse_size(text) : 0;
+    return size > 0 ? size : ARENA_DEFAULT_SIZE;
+}
+
+/* Smallest request that gets a mapping of its own, from MM_MMAP_THRESHOLD on first use */
+static size_t direct_threshold() {
+    if (persist != NULL) {
+        return SIZE_MAX;  // Everything must live in the file
+    }
+    size_t threshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+    if (threshold == 0) {
+        const char *text = getenv("MM_MMAP_THRESHOLD");
+        threshold = text == NULL ? MMAP_THRESHOLD_DEFAULT : parse_size(text);
+        if (threshold == 0) {
+            threshold = SIZE_MAX;
+        }
+        __atomic_store_n(&mmap_threshold, threshold, __ATOMIC_RELAXED);
+    }
+    return threshold;
+}
+
+void simple_mm_set_mmap_threshold(size_t threshold) {
+    __atomic_store_n(&mmap_threshold, threshold ? threshold : SIZE_MAX, __ATOMIC_RELAXED);
+}
+
+/* Maps a block of its own for a large request; no arena lock is needed */
+static void *direct_alloc(size_t aligned_size) {
+    size_t length = (aligned_size + 2 * sizeof(BlockHeader) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    BlockHeader *mapping = memory_map_segment(length);
+    if (mapping == NULL) {
+        TRACE_EVENT(MM_TRACE_FAIL, aligned_size, NULL);
+        return NULL;
+    }
+
+    // The header takes the second word, so the user area starts 16 bytes into the page
+    BlockHeader *block = mapping + 1;
+    block->size = (length - 2 * sizeof(BlockHeader)) | MMAPPED;
+    __atomic_fetch_add(&stat_direct_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat_direct_bytes, length, __ATOMIC_RELAXED);
+    return (void *)(block + 1);
+}
+
+static void direct_free(BlockHeader *block) {
+    size_t length = SIZE(block) + 2 * sizeof(BlockHeader);
+    __atomic_fetch_sub(&stat_direct_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&stat_direct_bytes, length, __ATOMIC_RELAXED);
+    memory_unmap_segment(block - 1, length);
+}
+
+/* Finds a free block of at least size bytes, mapping a new segment if none is left */
+static BlockHeader *arena_find(size_t size) {
+    BlockHeader *block = find_fit(size);
+    if (block != NULL) {
+        return block;
+    }
+
+    // Sliding handle blocks together may open a large enough gap without growing the arena
+    if (movable_blocks != 0 && stat_free_bytes >= size && compact_all() != 0) {
+        block = find_fit(size);
+        if (block != NULL) {
+            return block;
+        }
+    }
+
+    if (persist != NULL) {
+        return NULL;  // A persistent heap is its file and nothing more
+    }
+
+    // The segment must hold the block plus its own header and dummy block
+    size_t needed = size + sizeof(Segment) + 2 * sizeof(BlockHeader);
+    size_t grow;
+    if (segments == NULL) {
+        grow = configured_arena_size();
+    } else {
+        // Grow geometrically so the number of segments stays logarithmic in the heap size
+        grow = arena_mapped < SEGMENT_GROWTH_MAX ? arena_mapped : SEGMENT_GROWTH_MAX;
+    }
+
+    if (add_segment(grow > needed ? grow : needed) == NULL) {
+        return NULL;
+    }
+    return find_fit(size);
+}
+
+/* Maps the first segment with initial_size bytes before any allocation is made */
+int simple_mm_init(size_t initial_size) {
+    int result = -1;
+
+    ARENA_LOCK();
+    if (segments == NULL) {
+        size_t size = initial_size ? initial_size : configured_arena_size();
+        result = add_segment(size) != NULL ? 0 : -1;
+    }
+    ARENA_UNLOCK();
+    return result;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Smallest free block whose pages are released, from MM_TRIM_THRESHOLD on first use */
+static size_t trim_limit() {
+    if (trim_threshold == 0) {
+        const char *text = getenv("MM_TRIM_THRESHOLD");
+        const char *decay = getenv("MM_TRIM_DECAY_MS");
+        size_t threshold = text == NULL ? TRIM_THRESHOLD_DEFAULT : parse_size(text);
+        trim_threshold = threshold == 0 ? SIZE_MAX : threshold < PAGE_SIZE ? PAGE_SIZE : threshold;
+        trim_decay_ns = (decay == NULL ? TRIM_DECAY_DEFAULT : strtoull(decay, NULL, 10)) * 1000000u;
+    }
+    return trim_threshold;
+}
+
+void simple_mm_set_trim(size_t threshold, unsigned decay_ms) {
+    ARENA_LOCK();
+    trim_threshold = threshold == 0 ? SIZE_MAX : threshold < PAGE_SIZE ? PAGE_SIZE : threshold;
+    trim_decay_ns = (uint64_t)decay_ms * 1000000u;
+    if (trim_due != 0) {
+        trim_due = now_ns() + trim_decay_ns;  // A pending release waits for the new delay
+    }
+    ARENA_UNLOCK();
+}
+
+/* Releases the whole pages inside a free block, keeping its header, links and footer */
+static size_t trim_block(BlockHeader *block) {
+    if (RELEASED(block) == SIZE(block)) {
+        return 0;  // Released already and unchanged since
+    }
+    RELEASED(block) = SIZE(block);
+
+    uintptr_t start = ((uintptr_t)&RELEASED(block) + sizeof(size_t) + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)GET_NEXT(block) - sizeof(BlockHeader *)) & ~(uintptr_t)(PAGE_SIZE - 1);
+    if (end <= start) {
+        return 0;
+    }
+    memory_release_pages((void *)start, end - start);
+    return end - start;
+}
 
-            SET_FREE(current, 0);
-            BlockHeader *allocated_block = current;
-            current = GET_NEXT(current);
-            printf("Allocated block at %p with size %zu\n", allocated_block, SIZE(allocated_block));
-            return (void *)(allocated_block + 1);  // Return pointer to memory region after header
+#ifdef MM_BEST_FIT
+static size_t trim_tree(BlockHeader *node) {
+    size_t released = 0;
+    for (; node != NULL && SIZE(node) >= trim_threshold; node = TREE(node)->left) {
+        for (BlockHeader *b = node; b != NULL; b = LINKS(b)->next_free) {
+            released += trim_block(b);
         }
+        released += trim_tree(TREE(node)->right);
+    }
+    // Every block left of a node below the threshold is smaller still, only its right side can hold more
+    return node != NULL ? released + trim_tree(TREE(node)->right) : released;
+}
+#endif
 
-        current = GET_NEXT(current);  // Move to the next block
-        printf("Moving to next block: %p\n", current);
+/* Releases the pages of every free block at or above the threshold. Caller holds the arena lock */
+static size_t trim_pass() {
+    size_t released = 0;
+    size_t threshold = trim_limit();
+    trim_due = 0;
 
-        // If we complete one full cycle, attempt another to check for potential memory compaction opportunities
-        if (current == search_start) {
-            search_attempts++;
-            printf("Completed one cycle through memory, retrying to avoid fragmentation.\n");
-            if (search_attempts == 2) {
-                printf("Attempting to coalesce all blocks to defragment memory.\n");
-                coalesce_all_blocks();  // New defragmentation attempt
-                current = first;  // Start over after coalescing
+#ifdef MM_BEST_FIT
+    released += trim_tree(size_tree);
+#endif
+    for (int cls = next_nonempty_class(size_class(threshold)); cls >= 0; ) {
+        for (BlockHeader *b = free_lists[cls]; b != NULL; b = LINKS(b)->next_free) {
+            if (SIZE(b) >= threshold) {
+                released += trim_block(b);
             }
         }
+        cls = cls + 1 < NUM_CLASSES ? next_nonempty_class(cls + 1) : -1;
+    }
+    return released;
+}
+
+/* Runs the pending release once its decay delay has passed. Caller holds the arena lock */
+static void trim_if_due() {
+    if (trim_due != 0 && now_ns() >= trim_due) {
+        trim_pass();
+    }
+}
+
+size_t simple_mm_trim() {
+    ARENA_LOCK();
+    size_t released = trim_pass();
+    ARENA_UNLOCK();
+    return released;
+}
+
+/* Takes a block of aligned_size bytes from the free lists. Caller holds the arena lock */
+static void *arena_alloc(size_t aligned_size) {
+    BlockHeader *block = arena_find(aligned_size);
+    if (block == NULL) {
+        TRACE_EVENT(MM_TRACE_FAIL, aligned_size, NULL);
+        return NULL;  // Return NULL to indicate memory allocation failure
     }
 
-    // If no suitable block is found after two full cycles
-    printf("No suitable block found for size %zu after multiple attempts. Memory allocation failed!\n", aligned_size);
-    return NULL;  // Return NULL to indicate memory allocation failure
+    remove_free(block);
+    split_block(block, aligned_size);
+    SET_FREE(block, 0);
+    SET_PREV_FREE(GET_NEXT(block), 0);
+
+    // Thread caches keep small frees away from arena_free, so allocations check the delay too
+    trim_if_due();
+    return (void *)(block + 1);  // Return pointer to memory region after header
+}
+
+/* Returns a block to the free lists. Caller holds the arena lock */
+static void arena_free(BlockHeader *block) {
+    block->size &= ~OWNER_BITS;  // A free block belongs to no thread
+    SET_FREE(block, 1);
+    coalesce(block);
+
+    // Large free blocks that outlived the decay delay give their pages back
+    trim_if_due();
+}
+
+#ifdef MM_THREAD_SAFE
+/* Returns up to count blocks of a bin to the arena under a single lock */
+static void tcache_flush(ThreadCache *tc, int bin, int count) {
+    ARENA_LOCK();
+    while (count-- > 0 && tc->bins[bin] != NULL) {
+        BlockHeader *block = tc->bins[bin];
+        tc->bins[bin] = LINKS(block)->next_free;
+        tc->counts[bin]--;
+        arena_free(block);
+    }
+    ARENA_UNLOCK();
+}
+
+/* Empties a cache filled before the last detach, whose blocks lie in a heap that is no longer mapped */
+static void tcache_validate(ThreadCache *tc) {
+    unsigned generation = __atomic_load_n(&arena_generation, __ATOMIC_ACQUIRE);
+    if (tc->generation != generation) {
+        memset(tc->bins, 0, sizeof(tc->bins));
+        memset(tc->counts, 0, sizeof(tc->counts));
+        tc->generation = generation;
+    }
+}
+
+/* Thread exit destructor: hands every cached and remotely freed block back to the arena */
+static void tcache_release(void *arg) {
+    ThreadCache *tc = arg;
+    tcache_validate(tc);
+
+    if (tc->owner != 0) {
+        // Later remote frees see the closed stack and go to the arena themselves
+        BlockHeader *block = __atomic_exchange_n(&remote_frees[tc->owner], REMOTE_CLOSED, __ATOMIC_ACQUIRE);
+        ARENA_LOCK();
+        while (block != NULL) {
+            BlockHeader *next = LINKS(block)->next_free;
+            arena_free(block);
+            block = next;
+        }
+        owner_used[tc->owner] = 0;
+        ARENA_UNLOCK();
+        tc->owner = 0;
+    }
+
+    for (int bin = 0; bin < TCACHE_BINS; bin++) {
+        tcache_flush(tc, bin, tc->counts[bin]);
+    }
+}
+
+static void tcache_make_key() {
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+/* Arms the exit destructor and claims an owner id the first time a thread caches a block */
+static void tcache_register(ThreadCache *tc) {
+    pthread_once(&tcache_key_once, tcache_make_key);
+    pthread_setspecific(tcache_key, tc);
+    tc->registered = 1;
+
+    // Without a free id the thread's blocks are simply unowned
+    ARENA_LOCK();
+    for (int id = 1; id < MAX_OWNERS; id++) {
+        if (!owner_used[id]) {
+            owner_used[id] = 1;
+            __atomic_store_n(&remote_frees[id], NULL, __ATOMIC_RELAXED);
+            tc->owner = id;
+            break;
+        }
+    }
+    ARENA_UNLOCK();
+}
+
+/* Moves every block other threads have freed for this cache into its bins */
+static int tcache_reclaim(ThreadCache *tc) {
+    if (tc->owner == 0 || __atomic_load_n(&remote_frees[tc->owner], __ATOMIC_RELAXED) == NULL) {
+        return 0;
+    }
+
+    BlockHeader *block = __atomic_exchange_n(&remote_frees[tc->owner], NULL, __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        BlockHeader *next = LINKS(block)->next_free;
+        int bin = (LOAD_HEADER(block) & SIZE_BITS) >> 3;
+        LINKS(block)->next_free = tc->bins[bin];
+        tc->bins[bin] = block;
+        tc->counts[bin]++;
+        block = next;
+    }
+    return 1;
+}
+
+/* Hands a block to its owner's remote stack; returns 0 if the owner has exited */
+static int remote_free(unsigned owner, BlockHeader *block) {
+    BlockHeader *head = __atomic_load_n(&remote_frees[owner], __ATOMIC_RELAXED);
+    do {
+        if (head == REMOTE_CLOSED) {
+            return 0;
+        }
+        LINKS(block)->next_free = head;
+    } while (!__atomic_compare_exchange_n(&remote_frees[owner], &head, block, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+ * Fork handlers: the forking thread holds the arena lock across fork, so the
+ * child never inherits it locked by a thread that no longer exists. In the
+ * child only the forking thread survives, so the remote stacks of every other
+ * owner go back to the arena and are closed; blocks cached by those threads
+ * stay lost.
+ */
+static void fork_prepare() {
+    ARENA_LOCK();
+}
+
+static void fork_parent() {
+    ARENA_UNLOCK();
+}
+
+static void fork_child() {
+    for (int id = 1; id < MAX_OWNERS; id++) {
+        if (!owner_used[id] || id == tcache.owner) {
+            continue;
+        }
+        BlockHeader *block = __atomic_exchange_n(&remote_frees[id], REMOTE_CLOSED, __ATOMIC_ACQUIRE);
+        while (block != NULL) {
+            BlockHeader *next = LINKS(block)->next_free;
+            arena_free(block);
+            block = next;
+        }
+        owner_used[id] = 0;
+    }
+    ARENA_UNLOCK();
+}
+
+/* Registered before main, so even a fork ahead of the first allocation is covered */
+__attribute__((constructor)) static void fork_register() {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/* Allocates a batch of blocks under a single lock, returns one and caches the rest */
+static void *tcache_refill(ThreadCache *tc, size_t aligned_size) {
+    int bin = aligned_size >> 3;
+    void *result;
+
+    if (!tc->registered) {
+        tcache_register(tc);
+    }
+
+    // Blocks other threads gave back come first, as they need no lock
+    if (tcache_reclaim(tc) && tc->bins[bin] != NULL) {
+        BlockHeader *block = tc->bins[bin];
+        tc->bins[bin] = LINKS(block)->next_free;
+        tc->counts[bin]--;
+        return (void *)(block + 1);
+    }
+
+    ARENA_LOCK();
+    result = arena_alloc(aligned_size);
+    if (result != NULL) {
+        ((BlockHeader *)result - 1)->size |= (size_t)tc->owner << OWNER_SHIFT;
+    }
+    for (int n = 1; result != NULL && n < TCACHE_BATCH; n++) {
+        void *ptr = arena_alloc(aligned_size);
+        if (ptr == NULL) {
+            break;
+        }
+        BlockHeader *block = (BlockHeader *)ptr - 1;
+        block->size |= (size_t)tc->owner << OWNER_SHIFT;
+        LINKS(block)->next_free = tc->bins[bin];
+        tc->bins[bin] = block;
+        tc->counts[bin]++;
+    }
+    ARENA_UNLOCK();
+    return result;
+}
+#endif
+
+/* Allocates a block of memory; the public entry points add profiling with their caller */
+static void *malloc_block(size_t size) {
+    if (size > MAX_REQUEST) {
+        TRACE_EVENT(MM_TRACE_FAIL, size, NULL);
+        return NULL;
+    }
+    size_t aligned_size = align_request(size);
+
+#ifdef MM_THREAD_SAFE
+    // Small requests are served from the calling thread's cache without locking
+    if (aligned_size <= TCACHE_LIMIT) {
+        ThreadCache *tc = &tcache;
+        int bin = aligned_size >> 3;
+        tcache_validate(tc);
+        BlockHeader *block = tc->bins[bin];
+        void *ptr;
+        if (block != NULL) {
+            tc->bins[bin] = LINKS(block)->next_free;
+            tc->counts[bin]--;
+            ptr = (void *)(block + 1);
+        } else {
+            ptr = tcache_refill(tc, aligned_size);
+        }
+        TRACE_EVENT(MM_TRACE_MALLOC, size, ptr);
+        return ptr;
+    }
+#endif
+
+    void *ptr;
+    if (aligned_size >= direct_threshold()) {
+        ptr = direct_alloc(aligned_size);
+    } else {
+        ARENA_LOCK();
+        ptr = arena_alloc(aligned_size);
+        ARENA_UNLOCK();
+    }
+    TRACE_EVENT(MM_TRACE_MALLOC, size, ptr);
+    return ptr;
+}
+
+void* simple_malloc(size_t size) {
+    void *ptr = malloc_block(size);
+    PROFILE_ALLOC(ptr, size);
+    return ptr;
 }
 
 /* Frees the allocated block */
@@ -116,55 +1053,1018 @@ void simple_free(void *ptr) {
     if (!ptr) return;
 
     BlockHeader *block = (BlockHeader *)ptr - 1;
-    SET_FREE(block, 1);
-    coalesce(block);
+    TRACE_EVENT(MM_TRACE_FREE, 0, ptr);
+
+    size_t header = LOAD_HEADER(block);
+#ifdef MM_PROFILE
+    if (header & SAMPLED) {
+        profile_forget(ptr);
+        ARENA_LOCK();
+        block->size &= ~SAMPLED;  // Headers only change under the arena lock
+        ARENA_UNLOCK();
+    }
+#endif
+    if (header & MMAPPED) {
+        direct_free(block);
+        return;
+    }
+
+#ifdef MM_THREAD_SAFE
+    size_t size = header & SIZE_BITS;
+
+    // Small blocks go back to the calling thread's cache, overflow is flushed in a batch
+    if (size <= TCACHE_LIMIT) {
+        ThreadCache *tc = &tcache;
+        int bin = size >> 3;
+        if (!tc->registered) {
+            tcache_register(tc);
+        }
+        tcache_validate(tc);
+
+        // Another thread's block goes back to that thread without any lock
+        unsigned owner = GET_OWNER(header);
+        if (owner != 0 && owner != tc->owner && remote_free(owner, block)) {
+            return;
+        }
+
+        LINKS(block)->next_free = tc->bins[bin];
+        tc->bins[bin] = block;
+        if (++tc->counts[bin] > TCACHE_COUNT) {
+            tcache_flush(tc, bin, TCACHE_BATCH);
+        }
+        return;
+    }
+#endif
+
+    ARENA_LOCK();
+    arena_free(block);
+    ARENA_UNLOCK();
+}
+
+/* Allocates size bytes at a multiple of alignment, a power of two */
+void *simple_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= 16) {
+        void *ptr = malloc_block(size);  // Every block is already 16-byte aligned
+        PROFILE_ALLOC(ptr, size);
+        return ptr;
+    }
+
+    size_t min_block = sizeof(BlockHeader) + MIN_SIZE;
+    if (alignment > MAX_REQUEST - min_block || size > MAX_REQUEST - alignment - min_block) {
+        TRACE_EVENT(MM_TRACE_FAIL, size, NULL);
+        return NULL;  // The padded request below would not fit a header
+    }
+    size_t aligned_size = align_request(size);
+
+    ARENA_LOCK();
+
+    // Room for the request plus a leading gap that can always stand as a free block
+    BlockHeader *block = arena_find(aligned_size + alignment + min_block);
+    if (block == NULL) {
+        ARENA_UNLOCK();
+        TRACE_EVENT(MM_TRACE_FAIL, aligned_size, NULL);
+        return NULL;
+    }
+    remove_free(block);
+
+    uintptr_t user = ((uintptr_t)(block + 1) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (user != (uintptr_t)(block + 1)) {
+        // A gap too small to be a block moves us on to the next aligned address
+        while (user - sizeof(BlockHeader) - (uintptr_t)block < min_block) {
+            user += alignment;
+        }
+
+        // The leading gap stays behind as a free block instead of being wasted
+        BlockHeader *aligned = (BlockHeader *)user - 1;
+        aligned->size = (uintptr_t)GET_NEXT(block) - user;
+        SET_NEXT(block, aligned);
+        stat_blocks++;
+        FOOTER(block) = block;
+        insert_free(block);
+        SET_PREV_FREE(aligned, 1);
+        block = aligned;
+    }
+
+    split_block(block, aligned_size);
+    SET_FREE(block, 0);
+    SET_PREV_FREE(GET_NEXT(block), 0);
+    ARENA_UNLOCK();
+
+    TRACE_EVENT(MM_TRACE_MALLOC, size, block + 1);
+    PROFILE_ALLOC(block + 1, size);
+    return (void *)(block + 1);
+}
+
+/* Usable bytes of a block */
+size_t simple_malloc_usable_size(void *ptr) {
+    if (!ptr) return 0;
+
+    BlockHeader *block = (BlockHeader *)ptr - 1;
+    return LOAD_HEADER(block) & SIZE_BITS;
+}
+
+/* Allocates zeroed memory for an array of nmemb elements of size bytes */
+void *simple_calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;  // nmemb * size would overflow
+    }
+
+    void *ptr = malloc_block(nmemb * size);
+    if (ptr != NULL && !(LOAD_HEADER((BlockHeader *)ptr - 1) & MMAPPED)) {
+        memset(ptr, 0, nmemb * size);  // Fresh mappings are zeroed already
+    }
+    PROFILE_ALLOC(ptr, nmemb * size);
+    return ptr;
+}
+
+/* Trims an allocated block to size bytes, freeing the tail if it can hold a block */
+static void shrink_block(BlockHeader *block, size_t size) {
+    if (SIZE(block) - size >= sizeof(BlockHeader) + MIN_SIZE) {
+        BlockHeader *tail = (BlockHeader *)((uintptr_t)block + sizeof(BlockHeader) + size);
+        tail->size = SIZE(block) - size - sizeof(BlockHeader);
+        SET_SIZE(block, size);
+        stat_blocks++;
+        SET_FREE(tail, 1);
+        coalesce(tail);  // The tail may border a free block
+    }
+}
+
+/* Resizes an allocated block, in place whenever the block or its free successor allows it */
+void *simple_realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        void *new_ptr = malloc_block(size);
+        PROFILE_ALLOC(new_ptr, size);
+        return new_ptr;
+    }
+    if (size == 0) {
+        simple_free(ptr);
+        return NULL;
+    }
+    if (size > MAX_REQUEST) {
+        TRACE_EVENT(MM_TRACE_FAIL, size, NULL);
+        return NULL;  // The block is left untouched
+    }
+
+    BlockHeader *block = (BlockHeader *)ptr - 1;
+    size_t aligned_size = align_request(size);
+    TRACE_EVENT(MM_TRACE_REALLOC, size, ptr);
+
+    if (LOAD_HEADER(block) & MMAPPED) {
+        // A mapping is kept while the request still fits it and still counts as large
+        size_t old_size = SIZE(block);
+        if (aligned_size <= old_size && aligned_size >= direct_threshold()) {
+            return ptr;
+        }
+        void *new_ptr = malloc_block(size);
+        if (new_ptr != NULL) {
+            memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+            simple_free(ptr);
+            PROFILE_ALLOC(new_ptr, size);
+        }
+        return new_ptr;
+    }
+
+    ARENA_LOCK();
+    size_t old_size = SIZE(block);
+
+    // Grow by absorbing a free successor that makes up the difference
+    BlockHeader *next = GET_NEXT(block);
+    if (old_size < aligned_size && GET_FREE(next) &&
+        old_size + sizeof(BlockHeader) + SIZE(next) >= aligned_size) {
+        remove_free(next);
+        SET_NEXT(block, GET_NEXT(next));
+        stat_blocks--;
+        SET_PREV_FREE(GET_NEXT(block), 0);
+    }
+
+    if (SIZE(block) >= aligned_size) {
+        shrink_block(block, aligned_size);
+        ARENA_UNLOCK();
+        return ptr;
+    }
+    ARENA_UNLOCK();
+
+    // No room in place: move the contents to a new block
+    void *new_ptr = malloc_block(size);
+    if (new_ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size);
+        simple_free(ptr);
+        PROFILE_ALLOC(new_ptr, size);
+    }
+    return new_ptr;
 }
 
-/* Splits a block */
+/* Splits a block; the remainder is returned to the free lists */
 void split_block(BlockHeader *block, size_t size) {
-    size_t remaining_size = SIZE(block) - size - sizeof(BlockHeader);
+    size_t remaining_size = SIZE(block) - size;
 
     // Only split if the remaining size is large enough
     if (remaining_size >= sizeof(BlockHeader) + MIN_SIZE) {
         BlockHeader *new_block = (BlockHeader *)((uintptr_t)block + sizeof(BlockHeader) + size);
-        SET_NEXT(new_block, GET_NEXT(block));
-        SET_NEXT(block, new_block);
+        new_block->size = remaining_size - sizeof(BlockHeader);
+        SET_SIZE(block, size);
+        stat_blocks++;
         SET_FREE(new_block, 1);  // Mark the new block as free
-        printf("Block at %p split into new block at %p with remaining size %zu\n", block, new_block, remaining_size);
+        FOOTER(new_block) = new_block;
+        insert_free(new_block);
+        TRACE_EVENT(MM_TRACE_SPLIT, SIZE(new_block), new_block);
     }
 }
 
-/* Coalesces adjacent free blocks */
+/* Coalesces a free block, which is not in any free list, with both of its neighbours */
 void coalesce(BlockHeader *block) {
     BlockHeader *next = GET_NEXT(block);
-    
-    // Ensure we don't coalesce past the last block (dummy block)
-    while (GET_FREE(next) && next != first) {
-        printf("Coalescing block at %p with next block at %p\n", block, next);
+
+    // Neighbours are never both free, so one merge in each direction is enough
+    if (GET_FREE(next)) {
+        remove_free(next);
         SET_NEXT(block, GET_NEXT(next));  // Merge the current block with the next block
+        stat_blocks--;
+    }
+
+    if (GET_PREV_FREE(block)) {
+        BlockHeader *prev = PREV_FOOTER(block);
+        remove_free(prev);
+        SET_NEXT(prev, GET_NEXT(block));  // Merge the previous block with the current block
+        stat_blocks--;
+        block = prev;
+    }
+
+    FOOTER(block) = block;
+    SET_PREV_FREE(GET_NEXT(block), 1);
+    insert_free(block);
+    TRACE_EVENT(MM_TRACE_COALESCE, SIZE(block), block);
+
+    // A freshly freed large block is dirty until the next release pass after the decay delay
+    if (SIZE(block) >= trim_limit()) {
+        RELEASED(block) = 0;
+        if (trim_due == 0) {
+            trim_due = now_ns() + trim_decay_ns;
+        }
+    }
+}
+
+/* Movable blocks: the user area starts with a pointer back to the handle, the data follows it */
+#define HANDLE_CHUNK      PAGE_SIZE      // Bytes of handle entries mapped at a time, outside the arena
+#define HANDLE_OF(p)      (*(MMHandle **)((BlockHeader *)(p) + 1))
+#define HANDLE_DATA(p)    ((void *)(&HANDLE_OF(p) + 1))
+
+struct mm_handle {
+    union {
+        BlockHeader *block;      // Block holding the data
+        MMHandle *next_unused;   // Link while the entry sits in the pool
+    };
+    size_t locks;                // Outstanding simple_handle_lock calls; a locked block stays put
+};
+
+static MMHandle *handle_pool = NULL;  // Unused handle entries
+
+MMHandle *simple_handle_alloc(size_t size) {
+    // Handle entries live outside the arena, so they could not follow a persistent heap
+    if (persist != NULL || size > MAX_REQUEST - sizeof(MMHandle *)) {
+        return NULL;
+    }
+
+    ARENA_LOCK();
+    if (handle_pool == NULL) {
+        MMHandle *chunk = memory_map_segment(HANDLE_CHUNK);
+        if (chunk == NULL) {
+            ARENA_UNLOCK();
+            return NULL;
+        }
+        for (size_t i = 0; i < HANDLE_CHUNK / sizeof(MMHandle); i++) {
+            chunk[i].next_unused = handle_pool;
+            handle_pool = &chunk[i];
+        }
+    }
+
+    // Handle blocks always come from a segment, never a thread cache or a mapping of their own
+    void *ptr = arena_alloc(align_request(size + sizeof(MMHandle *)));
+    if (ptr == NULL) {
+        ARENA_UNLOCK();
+        return NULL;
+    }
+    MMHandle *handle = handle_pool;
+    handle_pool = handle->next_unused;
+    handle->block = (BlockHeader *)ptr - 1;
+    handle->locks = 0;
+    handle->block->size |= MOVABLE;
+    HANDLE_OF(handle->block) = handle;
+    movable_blocks++;
+    ARENA_UNLOCK();
+
+    TRACE_EVENT(MM_TRACE_MALLOC, size, ptr);
+    return handle;
+}
+
+void *simple_handle_lock(MMHandle *handle) {
+    ARENA_LOCK();
+    handle->locks++;
+    void *data = HANDLE_DATA(handle->block);
+    ARENA_UNLOCK();
+    return data;
+}
+
+void simple_handle_unlock(MMHandle *handle) {
+    ARENA_LOCK();
+    handle->locks--;
+    ARENA_UNLOCK();
+}
+
+void simple_handle_free(MMHandle *handle) {
+    if (!handle) return;
+
+    ARENA_LOCK();
+    BlockHeader *block = handle->block;
+    TRACE_EVENT(MM_TRACE_FREE, 0, block + 1);
+    block->size &= ~MOVABLE;
+    movable_blocks--;
+    arena_free(block);
+    handle->next_unused = handle_pool;
+    handle_pool = handle;
+    ARENA_UNLOCK();
+}
+
+/* Slides the unlocked handle blocks of a segment down over the free blocks before them */
+static size_t compact_segment(Segment *seg) {
+    size_t moved = 0;
+    BlockHeader *hole = NULL;  // Start of the free run being pushed up, NULL outside a run
+    BlockHeader *dummy = SEG_DUMMY(seg);
+
+    for (BlockHeader *block = SEG_FIRST(seg), *next; ; block = next) {
         next = GET_NEXT(block);
+
+        if (block != dummy && GET_FREE(block)) {
+            // Free blocks are absorbed into the run and rebuilt as one block when it ends
+            remove_free(block);
+            stat_blocks--;
+            if (hole == NULL) {
+                hole = block;
+            }
+        } else if (block != dummy && hole != NULL && (block->size & MOVABLE) && HANDLE_OF(block)->locks == 0) {
+            size_t length = sizeof(BlockHeader) + SIZE(block);
+            memmove(hole, block, length);
+            SET_PREV_FREE(hole, 0);
+            HANDLE_OF(hole)->block = hole;
+            hole = (BlockHeader *)((uintptr_t)hole + length);
+            moved += length;
+        } else if (hole != NULL) {
+            // A pinned block or the segment end closes the run, which holds at least one block
+            hole->size = (uintptr_t)block - (uintptr_t)(hole + 1);
+            SET_FREE(hole, 1);
+            stat_blocks++;
+            coalesce(hole);
+            hole = NULL;
+        }
+
+        if (block == dummy) {
+            return moved;
+        }
+    }
+}
+
+/* Compacts every segment and returns the bytes moved. Caller holds the arena lock */
+static size_t compact_all() {
+    size_t moved = 0;
+    if (movable_blocks == 0) {
+        return 0;
     }
+    for (Segment *seg = segments; seg != NULL; seg = seg->next) {
+        moved += compact_segment(seg);
+    }
+    return moved;
+}
 
-    printf("Final coalesced block at %p with size %zu\n", block, SIZE(block));
+size_t simple_mm_compact() {
+    ARENA_LOCK();
+    size_t moved = compact_all();
+    ARENA_UNLOCK();
+    return moved;
 }
 
+/* Persistent heaps: the file starts with this header, its single segment follows */
+#define PERSIST_MAGIC    0x3250414548534d4dull   // "MMSHEAP2", bump the digit when blocks change
+#define PERSIST_SPACE    ((sizeof(PersistHeader) + 63) & ~(size_t)63)
+#define PERSIST_SEGMENT(length) (((length) - PERSIST_SPACE) & ~(size_t)15)  // Keeps the dummy block aligned
+#ifdef MM_BEST_FIT
+#define PERSIST_LAYOUT   (sizeof(PersistHeader) | (uint64_t)1 << 32)   // The saved index has a tree
+#else
+#define PERSIST_LAYOUT   sizeof(PersistHeader)
+#endif
 
-/* Defragmentation: Coalesces all free blocks */
-void coalesce_all_blocks() {
-    BlockHeader *block = first;
-    BlockHeader *start = first;  // Keep track of the starting block to detect a full cycle
+struct persist_header {
+    uint64_t magic;
+    uint64_t layout;         // Format of the saved index, which depends on the build
+    uint64_t clean;          // Set by simple_mm_detach, cleared while attached
+    uintptr_t base;          // Address the saved pointers are valid at
+    size_t size;             // Bytes of the file
+    size_t root;             // Offset of the root object, 0 for none
 
-    do {
+    // Free index and counters as simple_mm_detach left them
+    size_t usable;
+    size_t blocks;
+    size_t free_blocks;
+    size_t free_bytes;
+    uint64_t class_map[MAP_WORDS];
+    BlockHeader *free_lists[NUM_CLASSES];
+    BlockHeader *size_tree;
+};
+
+/* Drops the arena from the allocator's state; the memory itself is left alone */
+static void forget_arena() {
+    segments = NULL;
+    arena_mapped = 0;
+    stat_usable = stat_blocks = stat_free_blocks = stat_free_bytes = 0;
+    memset(free_lists, 0, sizeof(free_lists));
+    memset(class_map, 0, sizeof(class_map));
+    memset(rovers, 0, sizeof(rovers));
+#ifdef MM_BEST_FIT
+    size_tree = NULL;
+#endif
+    trim_due = 0;
+}
+
+/* Adds a free block found by rebuild_segment to the index */
+static void index_run(BlockHeader *block) {
+    FOOTER(block) = block;
+    insert_free(block);
+    if (SIZE(block) >= trim_limit()) {
+        RELEASED(block) = 0;  // Its pages may be resident
+    }
+}
+
+/* Checks the block chain of a segment and rebuilds the free index and counters from it */
+static int rebuild_segment(Segment *seg) {
+    BlockHeader *dummy = SEG_DUMMY(seg);
+    BlockHeader *run = NULL;  // Free block absorbing its free successors, NULL after an allocated block
+
+    stat_usable += seg->size - sizeof(Segment) - sizeof(BlockHeader);
+    for (BlockHeader *block = SEG_FIRST(seg), *next; block != dummy; block = next) {
+        size_t size = SIZE(block);
+        if (size < MIN_SIZE || (size & 15) != 8 || (block->size & MMAPPED) || size > (uintptr_t)dummy - (uintptr_t)(block + 1)) {
+            return -1;
+        }
+        next = GET_NEXT(block);
+
+        // Owners, samples and handles belong to the process that wrote them
+        block->size &= SIZE_BITS | 0x1;
         if (GET_FREE(block)) {
-            coalesce(block);  // Try to coalesce all free blocks
+            if (run == NULL) {
+                run = block;
+                stat_blocks++;
+            } else {
+                SET_NEXT(run, next);  // Neighbours left unmerged by a crash
+            }
+            continue;
         }
-        block = GET_NEXT(block);
+        if (run != NULL) {
+            index_run(run);
+        }
+        SET_PREV_FREE(block, run != NULL);
+        run = NULL;
+        stat_blocks++;
+    }
+
+    if (run != NULL) {
+        index_run(run);
+    }
+    dummy->size = 0;
+    SET_PREV_FREE(dummy, run != NULL);
+    return 0;
+}
+
+/* Adopts a mapped heap file as the arena. Caller holds the arena lock */
+static int open_persistent(PersistHeader *header, size_t length) {
+    Segment *seg = (Segment *)((uintptr_t)header + PERSIST_SPACE);
+    int result;
+
+    if (header->magic == 0) {
+        if (length < PERSIST_SPACE + sizeof(Segment) + 2 * sizeof(BlockHeader) + MIN_SIZE) {
+            return -1;
+        }
+        header->magic = PERSIST_MAGIC;
+        header->size = length;
+        header->root = 0;
+        format_segment(seg, PERSIST_SEGMENT(length));
+        result = MM_PERSIST_NEW;
+    } else if (header->magic != PERSIST_MAGIC || header->size != length || seg->size != PERSIST_SEGMENT(length)) {
+        return -1;  // Not a heap, or one that was truncated
+    } else if (header->clean && header->layout == PERSIST_LAYOUT && header->base == (uintptr_t)header) {
+        // Same address as when it was saved, so every pointer in the saved index still holds
+        segments = seg;
+        stat_usable = header->usable;
+        stat_blocks = header->blocks;
+        stat_free_blocks = header->free_blocks;
+        stat_free_bytes = header->free_bytes;
+        memcpy(class_map, header->class_map, sizeof(class_map));
+        memcpy(free_lists, header->free_lists, sizeof(free_lists));
+#ifdef MM_BEST_FIT
+        size_tree = header->size_tree;
+#endif
+        result = MM_PERSIST_CLEAN;
+    } else {
+        segments = seg;
+        if (rebuild_segment(seg) < 0) {
+            forget_arena();
+            return -1;
+        }
+        result = MM_PERSIST_REBUILT;
+    }
+
+    seg->next = NULL;
+    arena_mapped = length;
+    header->layout = PERSIST_LAYOUT;
+    header->base = (uintptr_t)header;
+    header->clean = 0;
+    persist = header;
+    return result;
+}
+
+int simple_mm_attach(const char *path, size_t size) {
+    size_t length;
+    int result = -1;
 
-        // Add a safety check to prevent infinite loops
-        if (block == start) {
-            printf("Warning: Detected potential infinite loop in coalesce_all_blocks function.\n");
+    ARENA_LOCK();
+    if (segments == NULL) {
+        PersistHeader *header = memory_map_file(path, size, NULL, &length);
+
+        // Saved pointers are only valid at the old base, so move the mapping there if it is free
+        if (header != NULL && header->magic == PERSIST_MAGIC && header->base != (uintptr_t)header) {
+            void *base = (void *)header->base;
+            memory_unmap_segment(header, length);
+            header = memory_map_file(path, 0, base, &length);
+        }
+
+        if (header != NULL) {
+            result = open_persistent(header, length);
+            if (result < 0) {
+                memory_unmap_segment(header, length);
+            }
+        }
+    }
+    ARENA_UNLOCK();
+    return result;
+}
+
+int simple_mm_detach() {
+#ifdef MM_THREAD_SAFE
+    // The calling thread's cached blocks go back first, so the saved index covers them
+    tcache_validate(&tcache);
+    tcache_reclaim(&tcache);
+    for (int bin = 0; bin < TCACHE_BINS; bin++) {
+        tcache_flush(&tcache, bin, tcache.counts[bin]);
+    }
+#endif
+
+    ARENA_LOCK();
+    PersistHeader *header = persist;
+    if (header == NULL) {
+        ARENA_UNLOCK();
+        return -1;
+    }
+
+    // Owner ids belong to this process; the next one to attach would push frees onto stacks nobody drains
+    for (BlockHeader *block = SEG_FIRST(segments); block != SEG_DUMMY(segments); block = GET_NEXT(block)) {
+        block->size &= ~OWNER_BITS;
+    }
+
+    header->usable = stat_usable;
+    header->blocks = stat_blocks;
+    header->free_blocks = stat_free_blocks;
+    header->free_bytes = stat_free_bytes;
+    memcpy(header->class_map, class_map, sizeof(class_map));
+    memcpy(header->free_lists, free_lists, sizeof(free_lists));
+#ifdef MM_BEST_FIT
+    header->size_tree = size_tree;
+#else
+    header->size_tree = NULL;
+#endif
+    header->clean = 1;
+
+#ifdef MM_THREAD_SAFE
+    // Other threads' caches and remote stacks still point into the file: they are dropped, not read
+    for (int id = 1; id < MAX_OWNERS; id++) {
+        BlockHeader *head = __atomic_load_n(&remote_frees[id], __ATOMIC_RELAXED);
+        while (head != NULL && head != REMOTE_CLOSED &&
+               !__atomic_compare_exchange_n(&remote_frees[id], &head, NULL, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+    __atomic_fetch_add(&arena_generation, 1, __ATOMIC_RELEASE);
+#endif
+
+    persist = NULL;
+    forget_arena();
+    memory_unmap_segment(header, header->size);
+    ARENA_UNLOCK();
+    return 0;
+}
+
+void simple_mm_set_root(void *ptr) {
+    ARENA_LOCK();
+    if (persist != NULL) {
+        persist->root = ptr != NULL ? (uintptr_t)ptr - (uintptr_t)persist : 0;
+    }
+    ARENA_UNLOCK();
+}
+
+void *simple_mm_root() {
+    ARENA_LOCK();
+    void *root = persist != NULL && persist->root != 0 ? (char *)persist + persist->root : NULL;
+    ARENA_UNLOCK();
+    return root;
+}
+
+
+/* Size of the largest free block, found from the top non-empty part of the index */
+static size_t largest_free() {
+#ifdef MM_BEST_FIT
+    if (size_tree != NULL) {
+        BlockHeader *node = size_tree;
+        while (TREE(node)->right != NULL) {
+            node = TREE(node)->right;
+        }
+        return SIZE(node);
+    }
+#endif
+    for (int w = MAP_WORDS - 1; w >= 0; w--) {
+        if (class_map[w] == 0) {
+            continue;
+        }
+        int cls = w * 64 + 63 - __builtin_clzll(class_map[w]);
+        size_t largest = 0;
+
+        // Small classes hold a single size; a large class is scanned for its biggest block
+        for (BlockHeader *b = free_lists[cls]; b != NULL; b = LINKS(b)->next_free) {
+            if (SIZE(b) > largest) {
+                largest = SIZE(b);
+            }
+            if (cls < NUM_SMALL) {
+                break;
+            }
+        }
+        return largest;
+    }
+    return 0;
+}
+
+/* Reports heap usage from the running counters, without walking the blocks */
+MMStats simple_mm_stats() {
+    MMStats stats;
+
+    ARENA_LOCK();
+    stats.bytes_mapped = arena_mapped;
+    stats.bytes_free = stat_free_bytes;
+    stats.bytes_in_use = stat_usable - stat_blocks * sizeof(BlockHeader) - stat_free_bytes;
+    stats.free_blocks = stat_free_blocks;
+    stats.allocated_blocks = stat_blocks - stat_free_blocks;
+    stats.largest_free = largest_free();
+    stats.searches = stat_searches;
+    stats.blocks_scanned = stat_scanned;
+    ARENA_UNLOCK();
+
+    size_t direct_bytes = __atomic_load_n(&stat_direct_bytes, __ATOMIC_RELAXED);
+    size_t direct_blocks = __atomic_load_n(&stat_direct_blocks, __ATOMIC_RELAXED);
+    stats.bytes_mapped += direct_bytes;
+    stats.bytes_in_use += direct_bytes - direct_blocks * 2 * sizeof(BlockHeader);
+    stats.allocated_blocks += direct_blocks;
+
+    // External fragmentation: the share of free memory outside the largest free block
+    stats.fragmentation = stats.bytes_free ? 1.0 - (double)stats.largest_free / stats.bytes_free : 0.0;
+    return stats;
+}
+
+/* Copies the newest events out of the trace ring, oldest first */
+size_t simple_mm_trace_snapshot(MMTraceEvent *events, size_t max) {
+#ifdef MM_TRACE
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t count = head < MM_TRACE_CAPACITY ? head : MM_TRACE_CAPACITY;
+
+    if (count > max) {
+        count = max;
+    }
+    for (uint64_t n = 0; n < count; n++) {
+        events[n] = trace_ring[(head - count + n) & (MM_TRACE_CAPACITY - 1)];
+    }
+    return count;
+#else
+    return 0;
+#endif
+}
+
+/* Writes the trace ring to fd as raw MMTraceEvent records, oldest first */
+int simple_mm_trace_dump(int fd) {
+#ifdef MM_TRACE
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t count = head < MM_TRACE_CAPACITY ? head : MM_TRACE_CAPACITY;
+    uint64_t start = (head - count) & (MM_TRACE_CAPACITY - 1);
+
+    // The ring holds at most two runs: start up to the end, then the wrapped part
+    uint64_t runs[2][2] = { { start, MM_TRACE_CAPACITY - start }, { 0, 0 } };
+    if (runs[0][1] > count) {
+        runs[0][1] = count;
+    } else {
+        runs[1][1] = count - runs[0][1];
+    }
+
+    for (int r = 0; r < 2; r++) {
+        const char *bytes = (const char *)&trace_ring[runs[r][0]];
+        size_t left = runs[r][1] * sizeof(MMTraceEvent);
+        while (left > 0) {
+            ssize_t written = write(fd, bytes, left);
+            if (written < 0) {
+                return -1;
+            }
+            bytes += written;
+            left -= written;
+        }
+    }
+    return (int)count;
+#else
+    return 0;
+#endif
+}
+
+#ifdef MM_PROFILE
+#define PROFILE_RATE_DEFAULT  (512 * 1024)
+#define PROFILE_SITES         1024             // Must be a power of two
+#define PROFILE_SAMPLES       16384            // Live samples tracked at once, a power of two
+#define PROFILE_HASH(p)       (((uintptr_t)(p) * 0x9E3779B97F4A7C15ull) >> 40)
+
+typedef struct profile_site {
+    const void *site;        // Return address of the allocating call, NULL for an empty slot
+    size_t live_bytes;       // Estimated bytes still allocated from this site
+    size_t total_bytes;      // Estimated bytes ever allocated from this site
+    uint32_t live_samples;
+    uint32_t total_samples;
+} ProfileSite;
+
+typedef struct profile_entry {
+    const void *ptr;         // Sampled block, NULL for an empty slot
+    size_t weight;           // Bytes the sample stands for
+    uint32_t site;           // Index into profile_sites
+} ProfileEntry;
+
+static ProfileSite profile_sites[PROFILE_SITES];
+static ProfileEntry profile_entries[PROFILE_SAMPLES];
+static size_t profile_rate = 0;         // 0 until read from MM_PROFILE_RATE
+static uint8_t profile_lock = 0;        // Spin lock; samples are rare, so it is rarely contended
+
+#ifdef MM_THREAD_SAFE
+static _Thread_local uint64_t sample_seed;
+#else
+static uint64_t sample_seed;
+#endif
+
+static void profile_lock_acquire() {
+    while (__atomic_test_and_set(&profile_lock, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+static void profile_lock_release() {
+    __atomic_clear(&profile_lock, __ATOMIC_RELEASE);
+}
+
+static int profile_report(int fd, int wait);
+
+static void profile_at_exit() {
+    profile_report(STDERR_FILENO, 1);
+}
+
+static void profile_on_signal(int signo) {
+    profile_report(STDERR_FILENO, 0);
+}
+
+/* Reads MM_PROFILE_RATE and arms the exit and signal reports, once */
+static size_t profile_configure() {
+    profile_lock_acquire();
+    if (profile_rate == 0) {
+        const char *text = getenv("MM_PROFILE_RATE");
+        size_t rate = text != NULL ? parse_size(text) : 0;
+        __atomic_store_n(&profile_rate, rate > 0 ? rate : PROFILE_RATE_DEFAULT, __ATOMIC_RELAXED);
+
+        const char *number = getenv("MM_PROFILE_SIGNAL");
+        int signo = number != NULL ? atoi(number) : SIGUSR2;
+        if (signo > 0) {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = profile_on_signal;
+            action.sa_flags = SA_RESTART;
+            sigaction(signo, &action, NULL);
+        }
+        atexit(profile_at_exit);
+    }
+    size_t rate = profile_rate;
+    profile_lock_release();
+    return rate;
+}
+
+void simple_mm_set_profile_rate(size_t bytes) {
+    profile_configure();
+    profile_lock_acquire();
+    __atomic_store_n(&profile_rate, bytes > 0 ? bytes : PROFILE_RATE_DEFAULT, __ATOMIC_RELAXED);
+    profile_lock_release();
+    sample_countdown = 0;  // This thread draws its next interval at the new rate
+}
+
+/* Records a sample for ptr and draws the distance to the next one, uniform in [1, 2 * rate] */
+static void profile_sample(void *ptr, size_t size, const void *site) {
+    size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+    if (rate == 0) {
+        rate = profile_configure();
+    }
+
+    if (sample_seed == 0) {
+        sample_seed = ((uintptr_t)&sample_seed ^ now_ns()) | 1;
+        ptr = NULL;  // The first call of a thread only starts its countdown
+    }
+    sample_seed ^= sample_seed << 13;
+    sample_seed ^= sample_seed >> 7;
+    sample_seed ^= sample_seed << 17;
+    sample_countdown = 1 + (int64_t)(sample_seed % (2 * rate));
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    // A sample stands for the bytes allocated between two samples, or the block if larger
+    size_t weight = size > rate ? size : rate;
+
+    profile_lock_acquire();
+    uint32_t s = PROFILE_HASH(site) & (PROFILE_SITES - 1);
+    for (uint32_t n = 0; n < PROFILE_SITES && profile_sites[s].site != site; n++) {
+        if (profile_sites[s].site == NULL) {
+            profile_sites[s].site = site;
             break;
         }
-    } while ((uintptr_t)block >= (uintptr_t)first && (uintptr_t)block < (uintptr_t)memory_end);
+        s = (s + 1) & (PROFILE_SITES - 1);
+    }
+
+    uint32_t e = PROFILE_HASH(ptr) & (PROFILE_SAMPLES - 1);
+    for (uint32_t n = 0; n < PROFILE_SAMPLES && profile_entries[e].ptr != NULL; n++) {
+        e = (e + 1) & (PROFILE_SAMPLES - 1);
+    }
+
+    // A full table drops the sample rather than grow inside the allocator
+    int recorded = profile_sites[s].site == site && profile_entries[e].ptr == NULL;
+    if (recorded) {
+        profile_entries[e].ptr = ptr;
+        profile_entries[e].weight = weight;
+        profile_entries[e].site = s;
+        profile_sites[s].live_bytes += weight;
+        profile_sites[s].total_bytes += weight;
+        profile_sites[s].live_samples++;
+        profile_sites[s].total_samples++;
+    }
+    profile_lock_release();
+
+    // Mark the block so simple_free knows to drop the sample; headers only change under the arena lock
+    if (recorded) {
+        ARENA_LOCK();
+        ((BlockHeader *)ptr - 1)->size |= SAMPLED;
+        ARENA_UNLOCK();
+    }
 }
 
+/* Drops the sample of a freed block, closing the gap with a backward shift */
+static void profile_forget(void *ptr) {
+    profile_lock_acquire();
+    uint32_t e = PROFILE_HASH(ptr) & (PROFILE_SAMPLES - 1);
+    for (uint32_t n = 0; n < PROFILE_SAMPLES && profile_entries[e].ptr != ptr; n++) {
+        if (profile_entries[e].ptr == NULL) {
+            profile_lock_release();
+            return;
+        }
+        e = (e + 1) & (PROFILE_SAMPLES - 1);
+    }
+
+    ProfileSite *site = &profile_sites[profile_entries[e].site];
+    site->live_bytes -= profile_entries[e].weight;
+    site->live_samples--;
+
+    // Move later entries of the probe run back so lookups never stop at the hole
+    uint32_t hole = e;
+    for (uint32_t next = (e + 1) & (PROFILE_SAMPLES - 1); profile_entries[next].ptr != NULL;
+         next = (next + 1) & (PROFILE_SAMPLES - 1)) {
+        uint32_t home = PROFILE_HASH(profile_entries[next].ptr) & (PROFILE_SAMPLES - 1);
+        if (((next - home) & (PROFILE_SAMPLES - 1)) >= ((next - hole) & (PROFILE_SAMPLES - 1))) {
+            profile_entries[hole] = profile_entries[next];
+            hole = next;
+        }
+    }
+    profile_entries[hole].ptr = NULL;
+    profile_lock_release();
+}
+
+/* Appends value in the given base, right-aligned in width characters, and returns the new end */
+static char *append_number(char *out, uint64_t value, unsigned base, int width) {
+    char digits[24];
+    int count = 0;
+    do {
+        digits[count++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+
+    while (width-- > count) {
+        *out++ = ' ';
+    }
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+static char *append_text(char *out, const char *text) {
+    while (*text) {
+        *out++ = *text++;
+    }
+    return out;
+}
+
+static int write_all(int fd, const char *bytes, size_t left) {
+    while (left > 0) {
+        ssize_t written = write(fd, bytes, left);
+        if (written < 0) {
+            return -1;
+        }
+        bytes += written;
+        left -= written;
+    }
+    return 0;
+}
+
+/*
+ * Writes the sites by live bytes, largest first. Only async-signal-safe calls are
+ * used, and a signal that finds the tables locked skips the report.
+ */
+static int profile_report(int fd, int wait) {
+    if (wait) {
+        profile_lock_acquire();
+    } else if (__atomic_test_and_set(&profile_lock, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    uint16_t order[PROFILE_SITES];
+    int count = 0;
+    size_t live = 0, total = 0;
+    for (int s = 0; s < PROFILE_SITES; s++) {
+        if (profile_sites[s].site == NULL) {
+            continue;
+        }
+        live += profile_sites[s].live_bytes;
+        total += profile_sites[s].total_bytes;
+
+        // Insertion sort, the table is small and this may run in a signal handler
+        int i = count++;
+        while (i > 0 && profile_sites[order[i - 1]].live_bytes < profile_sites[s].live_bytes) {
+            order[i] = order[i - 1];
+            i--;
+        }
+        order[i] = s;
+    }
+
+    char line[160];
+    char *end = append_text(line, "heap profile: ");
+    end = append_number(end, count, 10, 0);
+    end = append_text(end, " sites, ");
+    end = append_number(end, live, 10, 0);
+    end = append_text(end, " live bytes, ");
+    end = append_number(end, total, 10, 0);
+    end = append_text(end, " allocated bytes, 1 sample per ");
+    end = append_number(end, profile_rate, 10, 0);
+    end = append_text(end, " bytes\n");
+    int result = write_all(fd, line, end - line);
+
+    for (int i = 0; i < count && result == 0; i++) {
+        ProfileSite *site = &profile_sites[order[i]];
+        end = append_number(line, site->live_bytes, 10, 14);
+        end = append_text(end, " live ");
+        end = append_number(end, site->total_bytes, 10, 14);
+        end = append_text(end, " total ");
+        end = append_number(end, site->live_samples, 10, 8);
+        end = append_text(end, " / ");
+        end = append_number(end, site->total_samples, 10, 0);
+        end = append_text(end, " samples  0x");
+        end = append_number(end, (uintptr_t)site->site, 16, 0);
+        end = append_text(end, "\n");
+        result = write_all(fd, line, end - line);
+    }
+
+    profile_lock_release();
+    return result < 0 ? -1 : count;
+}
+#else
+void simple_mm_set_profile_rate(size_t bytes) {
+}
+#endif
+
+/* Writes the heap profile report to fd */
+int simple_mm_profile_dump(int fd) {
+#ifdef MM_PROFILE
+    return profile_report(fd, 1);
+#else
+    return 0;
+#endif
+}
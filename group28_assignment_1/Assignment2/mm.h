@@ -6,6 +6,9 @@
  *
  */
 
+#ifndef MM_H_
+#define MM_H_
+
 #include <stddef.h>
 #include <stdint.h>
 
@@ -13,7 +16,7 @@
 /**
  * @name    simple_malloc
  * @brief   Allocate at least size contiguous bytes of memory and return a pointer to the first byte.
- * @retval  Pointer to the start of the allocated memory or NULL if not possible.
+ * @retval  Pointer to the start of the allocated memory, 16-byte aligned, or NULL if not possible.
  */
 void * simple_malloc(size_t size);
 
@@ -26,16 +29,371 @@ void simple_free(void * ptr);
 
 
 /**
- * @name    The lowest address of the memory you will manage
- * @brief   This points to the lowest address of memory you will manage
+ * @name    simple_realloc
+ * @brief   Resizes the block at ptr to at least size bytes, keeping its contents.
+ *
+ * The block grows in place into a free successor and shrinks in place by splitting
+ * off its tail; only when neither works are the contents copied to a new block.
+ * A NULL ptr behaves like simple_malloc and a size of 0 like simple_free.
+ *
+ * @retval  Pointer to the resized memory, or NULL if not possible (ptr is then untouched).
+ */
+void * simple_realloc(void * ptr, size_t size);
+
+
+/**
+ * @name    simple_aligned_alloc
+ * @brief   Allocate at least size bytes starting at a multiple of alignment.
+ *
+ * alignment must be a power of two, e.g. 64 for a cache line or 4096 for a page.
+ * Any gap in front of the aligned block is kept as a free block, not wasted.
+ * The result is released with simple_free.
+ *
+ * @retval  Pointer to the aligned memory or NULL if not possible.
+ */
+void * simple_aligned_alloc(size_t alignment, size_t size);
+
+
+/**
+ * @name    simple_malloc_usable_size
+ * @brief   Number of bytes that can be used at ptr, at least the size requested for it.
+ * @retval  The usable size, or 0 for NULL.
+ */
+size_t simple_malloc_usable_size(void * ptr);
+
+
+/**
+ * @name    simple_calloc
+ * @brief   Allocate zeroed memory for an array of nmemb elements of size bytes each.
+ * @retval  Pointer to the zeroed memory or NULL if not possible (including on overflow).
+ */
+void * simple_calloc(size_t nmemb, size_t size);
+
+
+/**
+ * @name    simple_mm_init
+ * @brief   Maps the first arena segment with initial_size bytes (0 selects the default).
+ *
+ * Calling this is optional. Without it the first allocation maps a segment sized by
+ * the MM_ARENA_SIZE environment variable (e.g. "64M"), or 1 MB if it is unset. The
+ * arena then grows by mapping further segments whenever a request does not fit.
+ *
+ * @retval  0 on success, -1 if the arena already exists or the mapping failed.
+ */
+int simple_mm_init(size_t initial_size);
+
+
+/**
+ * @name    simple_mm_set_mmap_threshold
+ * @brief   Sets the request size from which a block gets an anonymous mapping of its own.
+ *
+ * Such blocks bypass the arena and are unmapped by simple_free. The default is 128 KB,
+ * or the MM_MMAP_THRESHOLD environment variable (e.g. "1M"). A threshold of 0 sends
+ * every request to the arena.
+ */
+void simple_mm_set_mmap_threshold(size_t threshold);
+
+
+/**
+ * @name    Page backing modes
+ * @brief   How memory_map_segment backs mappings that are a multiple of the segment granularity.
+ */
+#define MM_PAGES_SMALL        0   // 4 KB pages
+#define MM_PAGES_TRANSPARENT  1   // Huge-page aligned and advised for transparent huge pages
+#define MM_PAGES_EXPLICIT     2   // MAP_HUGETLB, falling back to transparent huge pages
+
+
+/**
+ * @name    memory_set_page_mode
+ * @brief   Selects the page backing of later mappings, overriding MM_HUGE_PAGES ("thp" or "explicit").
+ */
+void memory_set_page_mode(int mode);
+
+
+/**
+ * @name    memory_segment_granularity
+ * @brief   Size arena segments are rounded up to: 4 KB, or 2 MB when huge pages are selected.
+ */
+size_t memory_segment_granularity(void);
+
+
+/**
+ * @name    memory_map_segment
+ * @brief   Maps size bytes (a multiple of the page size) of zeroed memory for the arena.
+ * @retval  Page-aligned pointer to the memory, or NULL if it could not be mapped.
+ */
+void * memory_map_segment(size_t size);
+
+
+/**
+ * @name    memory_unmap_segment
+ * @brief   Returns size bytes at segment, a page-aligned range from memory_map_segment, to the OS.
+ */
+void memory_unmap_segment(void * segment, size_t size);
+
+
+/**
+ * @name    memory_release_pages
+ * @brief   Lets the OS reclaim the page-aligned range at start; it reads as zeros once touched again.
+ */
+void memory_release_pages(void * start, size_t size);
+
+
+/**
+ * @name    memory_map_file
+ * @brief   Maps the file at path shared and writable, creating it with size zero bytes if it is new or empty.
+ *
+ * The mapping is placed at base when that range is free, anywhere otherwise; base may be NULL.
+ *
+ * @retval  Pointer to the mapping with its length in *length, or NULL on failure.
+ */
+void * memory_map_file(const char * path, size_t size, void * base, size_t * length);
+
+
+/**
+ * @name    simple_mm_set_trim
+ * @brief   Configures how idle free memory inside the arena is returned to the OS.
+ *
+ * Once a free block of at least threshold bytes forms, the first call that reaches the
+ * arena lists after decay_ms milliseconds, a free or an allocation, releases the whole
+ * pages inside every free block of that size. Small requests served by a thread cache
+ * do not count, and a process that stops allocating keeps those pages until it calls
+ * simple_mm_trim. The defaults are 128 KB and 1000 ms, or the MM_TRIM_THRESHOLD and
+ * MM_TRIM_DECAY_MS environment variables. A threshold of 0 turns releasing off.
+ */
+void simple_mm_set_trim(size_t threshold, unsigned decay_ms);
+
+
+/**
+ * @name    simple_mm_trim
+ * @brief   Releases the pages of large free blocks now, without waiting for the decay delay.
+ * @retval  Number of bytes handed back to the OS.
+ */
+size_t simple_mm_trim(void);
+
+
+/**
+ * @name    Movable allocations
+ * @brief   Blocks reached through a handle, which the compactor may move while unlocked.
+ *
+ * Data is only valid between simple_handle_lock and the matching simple_handle_unlock;
+ * a locked block is pinned. When no free block fits a request, unlocked handle blocks
+ * are slid together before the arena grows, so they never pin fragmentation in place.
+ */
+typedef struct mm_handle MMHandle;  // Opaque type
+
+
+/**
+ * @name    simple_handle_alloc
+ * @brief   Allocates a movable block of size bytes, initially unlocked.
+ * @retval  Handle to the block, or NULL if memory ran out.
+ */
+MMHandle * simple_handle_alloc(size_t size);
+
+
+/**
+ * @name    simple_handle_lock
+ * @brief   Pins the block of a handle; locks nest.
+ * @retval  Pointer to the data, 8-byte aligned and valid until the last unlock.
  */
-extern const uintptr_t memory_start;
+void * simple_handle_lock(MMHandle * handle);
 
 
 /**
- * @name    The limit of the memory you will manage
- * @brief   This points to the first address of memory you will NOT manage
+ * @name    simple_handle_unlock
+ * @brief   Drops one lock taken with simple_handle_lock.
  */
-extern const uintptr_t memory_end;
+void simple_handle_unlock(MMHandle * handle);
 
 
+/**
+ * @name    simple_handle_free
+ * @brief   Frees the block of a handle and the handle itself.
+ */
+void simple_handle_free(MMHandle * handle);
+
+
+/**
+ * @name    simple_mm_compact
+ * @brief   Slides every unlocked handle block down over the free space before it.
+ *
+ * Each run of free and movable blocks up to the next pinned block ends as one free
+ * block. Ordinary allocations are never moved.
+ *
+ * @retval  Number of bytes moved.
+ */
+size_t simple_mm_compact(void);
+
+
+/**
+ * @name    Allocator statistics
+ * @brief   Snapshot of the heap returned by simple_mm_stats.
+ *
+ * Blocks held in a per-thread cache count as in use.
+ */
+typedef struct mm_stats {
+    size_t bytes_in_use;       // User bytes of allocated blocks
+    size_t bytes_free;         // User bytes of free blocks
+    size_t bytes_mapped;       // Bytes of all arena segments, headers included
+    size_t allocated_blocks;
+    size_t free_blocks;
+    size_t largest_free;       // User bytes of the largest free block
+    double fragmentation;      // 1 - largest_free / bytes_free, or 0 with nothing free
+    size_t searches;           // Lookups in the free index since start
+    size_t blocks_scanned;     // Free blocks those lookups examined; divide for the mean search length
+} MMStats;
+
+
+/**
+ * @name    Placement policies
+ * @brief   How a request picks among the free blocks of a size class that fit it.
+ *
+ * Small classes hold a single size, so the policies only differ for requests of
+ * 512 bytes and more.
+ */
+#define MM_FIT_FIRST   0   // The most recently freed block that fits
+#define MM_FIT_NEXT    1   // The first that fits after the block the class handed out last
+#define MM_FIT_BEST    2   // The smallest that fits
+
+
+/**
+ * @name    simple_mm_set_fit_policy
+ * @brief   Switches the placement policy at run time, overriding MM_POLICY ("first", "next", "best").
+ *
+ * The default is first fit. A POLICY=best build keeps large blocks in a size-ordered
+ * tree instead of lists, which only supports MM_FIT_BEST.
+ *
+ * @retval  The previous policy, or -1 if this build does not support the policy.
+ */
+int simple_mm_set_fit_policy(int policy);
+
+
+/**
+ * @name    Persistent heaps
+ * @brief   Results of simple_mm_attach.
+ */
+#define MM_PERSIST_NEW       0   // The file was empty and now holds a fresh heap
+#define MM_PERSIST_CLEAN     1   // Detached cleanly last time: the saved free index was taken as is
+#define MM_PERSIST_REBUILT   2   // Not detached or mapped at another address: the index was rebuilt
+
+
+/**
+ * @name    simple_mm_attach
+ * @brief   Makes the file at path the whole arena, so the heap outlives the process.
+ *
+ * Must be called before any allocation, or after simple_mm_detach. A new file is
+ * created with size bytes (at least a few pages); an existing one keeps its size.
+ * The file is mapped at the address it was last used at, where the free index
+ * saved by simple_mm_detach is reused in O(1) and pointers stored in the heap stay
+ * valid. A heap that was not detached, or that had to be mapped elsewhere, has its
+ * block chain checked and its free index rebuilt in one pass.
+ *
+ * While attached the heap never grows, large requests get no mapping of their own
+ * and handles are refused.
+ *
+ * @retval  MM_PERSIST_NEW, MM_PERSIST_CLEAN or MM_PERSIST_REBUILT, or -1 if the file is
+ *          not a heap, fails the check or an arena already exists.
+ */
+int simple_mm_attach(const char * path, size_t size);
+
+
+/**
+ * @name    simple_mm_detach
+ * @brief   Saves the free index in the file, marks it clean and unmaps it.
+ *
+ * Walks the heap once to drop the thread owner ids from allocated blocks, which
+ * mean nothing to the next process. Later allocations start a new anonymous arena.
+ * Blocks other threads hold in their caches or have yet to reclaim are dropped
+ * without being read, and stay allocated in the file. No other thread may
+ * allocate or free while the detach runs.
+ *
+ * @retval  0 on success, -1 if no persistent heap is attached.
+ */
+int simple_mm_detach(void);
+
+
+/**
+ * @name    simple_mm_set_root
+ * @brief   Records the entry point of the data in the persistent heap, kept as an offset in the file.
+ */
+void simple_mm_set_root(void * ptr);
+
+
+/**
+ * @name    simple_mm_root
+ * @retval  The pointer passed to simple_mm_set_root, at the current address of the heap, or NULL.
+ */
+void * simple_mm_root(void);
+
+
+/**
+ * @name    simple_mm_stats
+ * @brief   Reports heap usage from counters kept up to date by every malloc and free.
+ *
+ * Cheap enough to poll: only the largest free block is looked up, in the top size
+ * class list (or along the right spine of the best-fit tree).
+ *
+ * @retval  The current statistics.
+ */
+MMStats simple_mm_stats(void);
+
+
+/**
+ * @name    Allocator trace events
+ * @brief   One record of the trace ring kept when built with -DMM_TRACE (make TRACE=1).
+ */
+typedef struct mm_trace_event {
+    uint64_t cycles;    // Cycle counter when the event was recorded
+    uint64_t size;      // Requested or block size
+    uint64_t address;   // User pointer for malloc/free, block address otherwise
+    uint32_t op;        // One of the MM_TRACE_* codes
+    uint32_t reserved;
+} MMTraceEvent;
+
+#define MM_TRACE_MALLOC    1   // simple_malloc returned address (NULL on failure)
+#define MM_TRACE_FREE      2   // simple_free was called on address
+#define MM_TRACE_SPLIT     3   // A free remainder of size was split off at address
+#define MM_TRACE_COALESCE  4   // A free block of size was formed at address
+#define MM_TRACE_FAIL      5   // No block of size could be found
+#define MM_TRACE_REALLOC   6   // simple_realloc was asked to resize address to size
+
+
+/**
+ * @name    simple_mm_trace_snapshot
+ * @brief   Copies up to max of the most recent trace events into events, oldest first.
+ * @retval  Number of events copied. Always 0 when tracing is compiled out.
+ */
+size_t simple_mm_trace_snapshot(MMTraceEvent *events, size_t max);
+
+
+/**
+ * @name    simple_mm_trace_dump
+ * @brief   Writes the trace ring to the file descriptor fd as raw MMTraceEvent records.
+ * @retval  Number of events written, 0 when tracing is compiled out, or -1 on a write error.
+ */
+int simple_mm_trace_dump(int fd);
+
+
+/**
+ * @name    simple_mm_profile_dump
+ * @brief   Writes the heap profile of a -DMM_PROFILE build (make PROFILE=1) to fd as text.
+ *
+ * The profiler samples about one allocation per MM_PROFILE_RATE bytes (default 512K)
+ * and attributes it to the return address of the simple_malloc, simple_calloc,
+ * simple_realloc or simple_aligned_alloc call. Each line gives a site's estimated live
+ * and total bytes and its sample counts, largest live first; resolve the addresses
+ * with addr2line. The report is also written to stderr at exit and on the signal
+ * MM_PROFILE_SIGNAL (default SIGUSR2, 0 for none).
+ *
+ * @retval  Number of sites reported, 0 when profiling is not built in, -1 on a write error.
+ */
+int simple_mm_profile_dump(int fd);
+
+
+/**
+ * @name    simple_mm_set_profile_rate
+ * @brief   Sets the average number of bytes allocated between two profiler samples.
+ */
+void simple_mm_set_profile_rate(size_t bytes);
+
+#endif /* MM_H_ */
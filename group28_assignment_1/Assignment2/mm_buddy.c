@@ -0,0 +1,514 @@
+/**
+ * @file   mm_buddy.c
+ * @brief  Binary buddy backend for the simple_malloc interface (make BACKEND=buddy).
+ *
+ * Memory comes in regions of 2^region_order bytes, each aligned to its own
+ * size, so a block of order k always starts at a multiple of 2^k and its
+ * buddy is found by flipping bit k of its address. Every order has its own
+ * free list, and a bitmap of non-empty orders finds the smallest usable
+ * order with one bit scan. Allocation and free each split or merge at most
+ * region_order times, which bounds their worst case.
+ *
+ * Over-aligned blocks carry no header: the block start is the user pointer, a
+ * multiple of 32 where a header-led pointer never is, and the block order is
+ * kept in a byte map beside the region.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mm.h"
+
+#ifdef MM_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+typedef struct buddy_header {
+    uint8_t order;           // log2 of the block size, header included
+    uint8_t free;            // 1 while the block is in a free list
+    uint8_t reserved[14];    // Keeps user pointers 16-byte aligned
+} BuddyHeader;
+
+/* Links kept in the user area of a free block */
+typedef struct buddy_links {
+    BuddyHeader *next;
+    BuddyHeader *prev;
+} BuddyLinks;
+
+#define LINKS(b)             ((BuddyLinks *)((BuddyHeader *)(b) + 1))
+#define BUDDY(b, k)          ((BuddyHeader *)((uintptr_t)(b) ^ ((uintptr_t)1 << (k))))
+#define BLOCK_BYTES(k)       ((size_t)1 << (k))
+
+#define MIN_ORDER            5                       // 32 bytes: header plus free list links
+#define MAX_ORDER            40
+#define DEFAULT_REGION_ORDER 25                      // 32 MB, the size of the original arena
+#define MAX_REGIONS          64
+
+static BuddyHeader *free_lists[MAX_ORDER + 1];
+static uint64_t order_map = 0;                       // Bit k set when free_lists[k] is non-empty
+static int region_order = 0;                         // 0 until the first region is mapped
+static int region_count = 0;
+static uintptr_t region_bases[MAX_REGIONS];
+static uint8_t *aligned_maps[MAX_REGIONS];           // Per region, the order of each headerless block by 32-byte unit
+static size_t aligned_blocks = 0;                    // Headerless blocks allocated, the maps are skipped while 0
+
+/* Counters behind simple_mm_stats */
+static size_t stat_in_use = 0;                       // User bytes of allocated blocks
+static size_t stat_free = 0;                         // User bytes of free blocks
+static size_t stat_allocated_blocks = 0;
+static size_t stat_free_blocks = 0;
+
+#ifdef MM_THREAD_SAFE
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+#define ARENA_LOCK()   pthread_mutex_lock(&arena_lock)
+#define ARENA_UNLOCK() pthread_mutex_unlock(&arena_lock)
+
+/* The forking thread holds the lock across fork, so the child never inherits it held by another thread */
+static void fork_prepare() {
+    ARENA_LOCK();
+}
+
+static void fork_release() {
+    ARENA_UNLOCK();
+}
+
+__attribute__((constructor)) static void fork_register() {
+    pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+#else
+#define ARENA_LOCK()
+#define ARENA_UNLOCK()
+#endif
+
+static void push_free(BuddyHeader *block, int order) {
+    block->order = order;
+    block->free = 1;
+    LINKS(block)->prev = NULL;
+    LINKS(block)->next = free_lists[order];
+    if (free_lists[order]) {
+        LINKS(free_lists[order])->prev = block;
+    }
+    free_lists[order] = block;
+    order_map |= 1ULL << order;
+    stat_free += BLOCK_BYTES(order) - sizeof(BuddyHeader);
+    stat_free_blocks++;
+}
+
+static void unlink_free(BuddyHeader *block) {
+    int order = block->order;
+    BuddyHeader *next = LINKS(block)->next;
+    BuddyHeader *prev = LINKS(block)->prev;
+
+    if (prev) {
+        LINKS(prev)->next = next;
+    } else {
+        free_lists[order] = next;
+        if (!next) {
+            order_map &= ~(1ULL << order);
+        }
+    }
+    if (next) {
+        LINKS(next)->prev = prev;
+    }
+    block->free = 0;
+    stat_free -= BLOCK_BYTES(order) - sizeof(BuddyHeader);
+    stat_free_blocks--;
+}
+
+/* Smallest order whose block holds size user bytes, -1 if even the largest order cannot */
+static int order_for(size_t size) {
+    if (size > BLOCK_BYTES(MAX_ORDER) - sizeof(BuddyHeader)) {
+        return -1;
+    }
+    size_t bytes = size + sizeof(BuddyHeader);
+    int order = MIN_ORDER;
+    while (order <= MAX_ORDER && BLOCK_BYTES(order) < bytes) {
+        order++;
+    }
+    return order;
+}
+
+/* Region size from MM_ARENA_SIZE (bytes, with an optional K, M or G suffix), rounded up */
+static int configured_region_order(size_t size) {
+    const char *text = getenv("MM_ARENA_SIZE");
+    if (size == 0 && text != NULL) {
+        char *end;
+        size = strtoull(text, &end, 10);
+        switch (*end) {
+            case 'G': case 'g': size <<= 10;  // Fall through
+            case 'M': case 'm': size <<= 10;  // Fall through
+            case 'K': case 'k': size <<= 10;
+        }
+    }
+    if (size == 0) {
+        return DEFAULT_REGION_ORDER;
+    }
+
+    int order = 16;
+    while (order < MAX_ORDER && BLOCK_BYTES(order) < size) {
+        order++;
+    }
+    return order;
+}
+
+/* Map entry of a headerless block starting at block, 0 where a header-led block starts */
+static uint8_t *aligned_entry(void *block) {
+    uintptr_t base = (uintptr_t)block & ~(uintptr_t)(BLOCK_BYTES(region_order) - 1);
+    int i = 0;
+    while (region_bases[i] != base) {
+        i++;  // Regions are few, and only over-aligned blocks get here
+    }
+    return &aligned_maps[i][((uintptr_t)block - base) >> MIN_ORDER];
+}
+
+/* True if the block at address starts a free block of the given order */
+static int is_free_block(BuddyHeader *block, int order) {
+    if (aligned_blocks != 0 && *aligned_entry(block) != 0) {
+        return 0;  // User data of a headerless block, whatever it looks like
+    }
+    return block->free && block->order == order;
+}
+
+/* Maps one region aligned to its own size and frees it as a single block */
+static int add_region() {
+    if (region_count == MAX_REGIONS) {
+        return -1;
+    }
+
+    // The order map is touched only where headerless blocks start, so most of it stays unbacked
+    size_t size = BLOCK_BYTES(region_order);
+    uint8_t *map = memory_map_segment(size >> MIN_ORDER);
+    if (map == NULL) {
+        return -1;
+    }
+
+    // Over-map by one region so an aligned range fits, then give back the rest
+    char *raw = memory_map_segment(2 * size);
+    if (raw == NULL) {
+        memory_unmap_segment(map, size >> MIN_ORDER);
+        return -1;
+    }
+    uintptr_t base = ((uintptr_t)raw + size - 1) & ~(uintptr_t)(size - 1);
+    if (base > (uintptr_t)raw) {
+        memory_unmap_segment(raw, base - (uintptr_t)raw);
+    }
+    if (base + size < (uintptr_t)raw + 2 * size) {
+        memory_unmap_segment((void *)(base + size), (uintptr_t)raw + 2 * size - (base + size));
+    }
+
+    region_bases[region_count] = base;
+    aligned_maps[region_count] = map;
+    region_count++;
+    push_free((BuddyHeader *)base, region_order);
+    return 0;
+}
+
+/* Maps the first region with at least initial_size bytes */
+int simple_mm_init(size_t initial_size) {
+    int result = -1;
+
+    ARENA_LOCK();
+    if (region_order == 0) {
+        region_order = configured_region_order(initial_size);
+        result = add_region();
+    }
+    ARENA_UNLOCK();
+    return result;
+}
+
+/* Takes a block of the given order, splitting a larger one if needed. Caller holds the lock */
+static BuddyHeader *take_block(int order) {
+    if (region_order == 0) {
+        region_order = configured_region_order(0);
+    }
+    if (order > region_order) {
+        return NULL;
+    }
+
+    uint64_t usable = order_map >> order;
+    if (usable == 0) {
+        if (add_region() < 0) {
+            return NULL;
+        }
+        usable = order_map >> order;
+    }
+
+    int k = order + __builtin_ctzll(usable);
+    BuddyHeader *block = free_lists[k];
+    unlink_free(block);
+
+    // Hand the upper halves back until the block has the requested order
+    while (k > order) {
+        k--;
+        push_free(BUDDY(block, k), k);
+    }
+
+    block->order = order;
+    block->free = 0;
+    stat_in_use += BLOCK_BYTES(order) - sizeof(BuddyHeader);
+    stat_allocated_blocks++;
+    return block;
+}
+
+/* Frees a block, merging it with its buddy for as long as the buddy is free and whole */
+static void give_block(BuddyHeader *block) {
+    int order = block->order;
+    stat_in_use -= BLOCK_BYTES(order) - sizeof(BuddyHeader);
+    stat_allocated_blocks--;
+
+    while (order < region_order) {
+        BuddyHeader *buddy = BUDDY(block, order);
+        if (!is_free_block(buddy, order)) {
+            break;
+        }
+        unlink_free(buddy);
+        if (buddy < block) {
+            block = buddy;
+        }
+        order++;
+    }
+    push_free(block, order);
+}
+
+/* A header-led user pointer is 16 bytes past a block start, a headerless one is the start */
+static int is_headerless(void *ptr) {
+    return ((uintptr_t)ptr & (BLOCK_BYTES(MIN_ORDER) - 1)) == 0;
+}
+
+/* Usable bytes at ptr. Caller holds the lock */
+static size_t usable_bytes(void *ptr) {
+    if (is_headerless(ptr)) {
+        return BLOCK_BYTES(*aligned_entry(ptr));
+    }
+    return BLOCK_BYTES(((BuddyHeader *)ptr - 1)->order) - sizeof(BuddyHeader);
+}
+
+void *simple_malloc(size_t size) {
+    int order = order_for(size);
+    if (order < 0) {
+        return NULL;
+    }
+
+    ARENA_LOCK();
+    BuddyHeader *block = take_block(order);
+    ARENA_UNLOCK();
+    return block ? (void *)(block + 1) : NULL;
+}
+
+void simple_free(void *ptr) {
+    if (!ptr) return;
+
+    ARENA_LOCK();
+    if (is_headerless(ptr)) {
+        // The header goes back at the block start before the block is merged
+        uint8_t *entry = aligned_entry(ptr);
+        BuddyHeader *block = ptr;
+        block->order = *entry;
+        *entry = 0;
+        aligned_blocks--;
+        stat_in_use -= sizeof(BuddyHeader);
+        give_block(block);
+    } else {
+        give_block((BuddyHeader *)ptr - 1);
+    }
+    ARENA_UNLOCK();
+}
+
+void *simple_realloc(void *ptr, size_t size) {
+    if (!ptr) return simple_malloc(size);
+    if (size == 0) {
+        simple_free(ptr);
+        return NULL;
+    }
+
+    BuddyHeader *block = (BuddyHeader *)ptr - 1;
+    int order = order_for(size);
+    if (order < 0) {
+        return NULL;  // The block is left untouched
+    }
+
+    ARENA_LOCK();
+    size_t old_size = usable_bytes(ptr);
+    if (is_headerless(ptr)) {
+        // A headerless block keeps its place while the request fits, and is copied otherwise
+        if (size <= old_size) {
+            ARENA_UNLOCK();
+            return ptr;
+        }
+    } else {
+        // Shrink in place by freeing upper halves
+        while (block->order > order) {
+            int k = --block->order;
+            push_free(BUDDY(block, k), k);
+        }
+
+        // Grow in place while the block is a left half with a free, whole right buddy
+        while (block->order < order && block->order < region_order) {
+            BuddyHeader *buddy = BUDDY(block, block->order);
+            if (buddy < block || !is_free_block(buddy, block->order)) {
+                break;
+            }
+            unlink_free(buddy);
+            block->order++;
+        }
+
+        stat_in_use = stat_in_use - old_size + BLOCK_BYTES(block->order) - sizeof(BuddyHeader);
+        if (block->order >= order) {
+            ARENA_UNLOCK();
+            return ptr;
+        }
+    }
+    ARENA_UNLOCK();
+
+    // Copy as a last resort
+    void *new_ptr = simple_malloc(size);
+    if (new_ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        simple_free(ptr);
+    }
+    return new_ptr;
+}
+
+/* Blocks are aligned to their size, so a headerless block of 2^k >= alignment, size is aligned at its start */
+void *simple_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= sizeof(BuddyHeader)) {
+        return simple_malloc(size);
+    }
+    if (alignment > BLOCK_BYTES(MAX_ORDER) || size > BLOCK_BYTES(MAX_ORDER)) {
+        return NULL;
+    }
+    int order = MIN_ORDER;
+    while (BLOCK_BYTES(order) < alignment || BLOCK_BYTES(order) < size) {
+        order++;
+    }
+
+    ARENA_LOCK();
+    BuddyHeader *block = take_block(order);
+    if (block != NULL) {
+        // The whole block is user data, its order lives in the region's map
+        *aligned_entry(block) = order;
+        aligned_blocks++;
+        stat_in_use += sizeof(BuddyHeader);
+    }
+    ARENA_UNLOCK();
+    return block;
+}
+
+size_t simple_malloc_usable_size(void *ptr) {
+    if (!ptr) return 0;
+
+    ARENA_LOCK();
+    size_t usable = usable_bytes(ptr);
+    ARENA_UNLOCK();
+    return usable;
+}
+
+void *simple_calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    void *ptr = simple_malloc(nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+/* Every block comes from a region here, so there is no direct-mapping threshold to set */
+void simple_mm_set_mmap_threshold(size_t threshold) {
+}
+
+/* Regions are never trimmed by this backend */
+void simple_mm_set_trim(size_t threshold, unsigned decay_ms) {
+}
+
+size_t simple_mm_trim() {
+    return 0;
+}
+
+/* Buddy blocks never move: a handle is a small header in front of the data */
+struct mm_handle {
+    size_t reserved[2];      // Keeps the data as aligned as any other buddy allocation
+};
+
+MMHandle *simple_handle_alloc(size_t size) {
+    if (size > SIZE_MAX - sizeof(MMHandle)) {
+        return NULL;
+    }
+    return simple_malloc(sizeof(MMHandle) + size);
+}
+
+void *simple_handle_lock(MMHandle *handle) {
+    return handle + 1;
+}
+
+void simple_handle_unlock(MMHandle *handle) {
+}
+
+void simple_handle_free(MMHandle *handle) {
+    simple_free(handle);
+}
+
+size_t simple_mm_compact() {
+    return 0;
+}
+
+/* Regions are anonymous mappings, so there is no persistent heap */
+int simple_mm_attach(const char *path, size_t size) {
+    return -1;
+}
+
+int simple_mm_detach() {
+    return -1;
+}
+
+void simple_mm_set_root(void *ptr) {
+}
+
+void *simple_mm_root() {
+    return NULL;
+}
+
+/* Every block of an order has the same size, so there is nothing to choose between */
+int simple_mm_set_fit_policy(int policy) {
+    return -1;
+}
+
+MMStats simple_mm_stats() {
+    MMStats stats;
+
+    ARENA_LOCK();
+    stats.bytes_mapped = region_order ? region_count * BLOCK_BYTES(region_order) : 0;
+    stats.bytes_in_use = stat_in_use;
+    stats.bytes_free = stat_free;
+    stats.allocated_blocks = stat_allocated_blocks;
+    stats.free_blocks = stat_free_blocks;
+    stats.largest_free = order_map ? BLOCK_BYTES(63 - __builtin_clzll(order_map)) - sizeof(BuddyHeader) : 0;
+    ARENA_UNLOCK();
+    stats.searches = 0;          // An order is found with one bit scan, no list is searched
+    stats.blocks_scanned = 0;
+
+    stats.fragmentation = stats.bytes_free ? 1.0 - (double)stats.largest_free / stats.bytes_free : 0.0;
+    return stats;
+}
+
+/* The buddy backend does not record trace events */
+size_t simple_mm_trace_snapshot(MMTraceEvent *events, size_t max) {
+    return 0;
+}
+
+int simple_mm_trace_dump(int fd) {
+    return 0;
+}
+
+/* The buddy backend has no heap profiler */
+int simple_mm_profile_dump(int fd) {
+    return 0;
+}
+
+void simple_mm_set_profile_rate(size_t bytes) {
+}
@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include "mm.h"
+#include "pool.h"
+
+/* Header at the start of every chunk; the blocks follow it */
+typedef struct pool_chunk {
+    struct pool_chunk *next;     // Chunks of the pool, newest first
+} PoolChunk;
+
+struct block_pool {
+    _Alignas(64) uint64_t head;  // Tagged top of the free stack, on a cache line of its own
+    _Alignas(64) PoolChunk *chunks;
+    size_t block_size;
+    size_t per_chunk;            // Blocks carved from one chunk
+};
+
+#define TAG_SHIFT       48
+#define ADDRESS_BITS    (((uint64_t)1 << TAG_SHIFT) - 1)
+#define TOP(h)          ((void *)(uintptr_t)((h) & ADDRESS_BITS))
+#define TAGGED(p, h)    ((uint64_t)(uintptr_t)(p) | (((h) >> TAG_SHIFT) + 1) << TAG_SHIFT)  // Next tag after h's
+#define CHUNK_HEADER    ((sizeof(PoolChunk) + 7) & ~0x07)
+
+/* The link of a free block is its first word; stale poppers read it concurrently */
+#define NEXT(b)         __atomic_load_n((void **)(b), __ATOMIC_RELAXED)
+#define SET_NEXT(b, n)  __atomic_store_n((void **)(b), (n), __ATOMIC_RELAXED)
+
+/* Creates a pool for blocks of block_size bytes */
+BlockPool *pool_create(size_t block_size) {
+    if (block_size == 0 || block_size > POOL_CHUNK / 8) {
+        return NULL;
+    }
+
+    BlockPool *pool = simple_aligned_alloc(64, sizeof(BlockPool));
+    if (!pool) return NULL;
+
+    // Blocks must hold the stack link and stay 8-byte aligned
+    pool->block_size = (block_size + 7) & ~0x07;
+    pool->per_chunk = (POOL_CHUNK - CHUNK_HEADER) / pool->block_size;
+    pool->head = 0;
+    pool->chunks = NULL;
+    return pool;
+}
+
+/* Pushes the linked blocks first..last in one step */
+static void push_list(BlockPool *pool, void *first, void *last) {
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    do {
+        SET_NEXT(last, TOP(head));
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, TAGGED(first, head), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Carves a new chunk, keeps its first block for the caller and pushes the rest */
+static void *pool_grow(BlockPool *pool) {
+    PoolChunk *chunk = simple_malloc(POOL_CHUNK);
+    if (chunk == NULL || ((uintptr_t)chunk + POOL_CHUNK) > ADDRESS_BITS) {
+        simple_free(chunk);  // Addresses above 48 bits leave no room for the tag
+        return NULL;
+    }
+
+    // Chunks are only ever added until the pool is destroyed, so no tag is needed here
+    chunk->next = __atomic_load_n(&pool->chunks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pool->chunks, &chunk->next, chunk, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+
+    char *blocks = (char *)chunk + CHUNK_HEADER;
+    char *last = blocks + (pool->per_chunk - 1) * pool->block_size;
+    for (char *b = blocks + pool->block_size; b < last; b += pool->block_size) {
+        SET_NEXT(b, b + pool->block_size);
+    }
+    if (pool->per_chunk > 1) {
+        push_list(pool, blocks + pool->block_size, last);
+    }
+    return blocks;
+}
+
+/* Pops the top block, growing the pool when the stack is empty */
+void *pool_alloc(BlockPool *pool) {
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    for (;;) {
+        void *top = TOP(head);
+        if (top == NULL) {
+            return pool_grow(pool);
+        }
+        // A changed tag makes the CAS fail if top was popped and pushed back meanwhile
+        if (__atomic_compare_exchange_n(&pool->head, &head, TAGGED(NEXT(top), head), 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return top;
+        }
+    }
+}
+
+void pool_free(BlockPool *pool, void *block) {
+    if (!block) return;
+    push_list(pool, block, block);
+}
+
+/* Releases every chunk and the pool itself */
+void pool_destroy(BlockPool *pool) {
+    if (!pool) return;
+
+    while (pool->chunks != NULL) {
+        PoolChunk *next = pool->chunks->next;
+        simple_free(pool->chunks);
+        pool->chunks = next;
+    }
+    simple_free(pool);
+}
@@ -0,0 +1,55 @@
+/**
+ * @file   pool.h
+ * @brief  Lock-free pools of fixed-size blocks shared between threads, on the simple_malloc arena.
+ *
+ * Free blocks sit on a Treiber stack whose head is a tagged pointer: the low
+ * 48 bits hold the top block and the high 16 bits a counter bumped by every
+ * push and pop, so a pop that raced with a pop/push pair of the same block
+ * fails its compare-and-swap instead of corrupting the stack (ABA). Allocation
+ * and release are one CAS each; only an empty pool takes a new chunk from the
+ * arena. Chunks go back to the arena when the pool is destroyed, never before,
+ * so a stale reader of a popped block always reads mapped memory.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+#define POOL_CHUNK  (64 * 1024)   // Bytes taken from the arena each time the pool runs dry
+
+typedef struct block_pool BlockPool;  // Opaque type
+
+
+/**
+ * @name    pool_create
+ * @brief   Creates a pool of blocks of block_size bytes (at most POOL_CHUNK / 8).
+ * @retval  Handle to the pool, or NULL if the size is unsupported or memory ran out.
+ */
+BlockPool * pool_create(size_t block_size);
+
+
+/**
+ * @name    pool_alloc
+ * @brief   Takes a block from the pool without locking. Blocks are 8-byte aligned.
+ * @retval  Pointer to the block, or NULL if no chunk could be allocated.
+ */
+void * pool_alloc(BlockPool * pool);
+
+
+/**
+ * @name    pool_free
+ * @brief   Returns a block obtained from pool_alloc on the same pool, from any thread.
+ */
+void pool_free(BlockPool * pool, void * block);
+
+
+/**
+ * @name    pool_destroy
+ * @brief   Releases every chunk of the pool back to the arena, including live blocks.
+ *
+ * No other thread may use the pool any more.
+ */
+void pool_destroy(BlockPool * pool);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include "mm.h"
+#include "region.h"
+
+/* Header of every chunk taken from the arena; the bump area follows it */
+typedef struct chunk {
+    struct chunk *next;      // Older chunk
+    char *end;               // End of the bump area
+} Chunk;
+
+struct region {
+    Chunk *chunks;           // Bump chunks, newest first; the newest one is being carved
+    Chunk *large;            // Chunks holding a single large allocation, newest first
+    char *cur;               // Next free byte of the newest bump chunk
+    char *end;
+    size_t chunk_size;       // Size of the next bump chunk
+};
+
+#define REGION_CHUNK_MAX  (1024 * 1024)
+#define REGION_MAX_SIZE   (SIZE_MAX - sizeof(Chunk) - 7)   // Larger sizes would wrap when rounded or given a header
+#define CHUNK_DATA(c)     ((char *)((Chunk *)(c) + 1))
+
+static Chunk *chunk_create(size_t size) {
+    Chunk *chunk = simple_malloc(sizeof(Chunk) + size);
+    if (chunk != NULL) {
+        chunk->end = CHUNK_DATA(chunk) + size;
+    }
+    return chunk;
+}
+
+/* Gives chunks back to the arena until stop is reached */
+static void chunk_free_until(Chunk **list, Chunk *stop) {
+    while (*list != stop) {
+        Chunk *next = (*list)->next;
+        simple_free(*list);
+        *list = next;
+    }
+}
+
+/* Creates an empty region; its first chunk is taken on the first allocation */
+Region *region_create(size_t chunk_size) {
+    if (chunk_size > REGION_MAX_SIZE) {
+        return NULL;
+    }
+    Region *region = simple_malloc(sizeof(Region));
+    if (!region) return NULL;
+
+    region->chunks = NULL;
+    region->large = NULL;
+    region->cur = NULL;
+    region->end = NULL;
+    region->chunk_size = chunk_size ? (chunk_size + 7) & ~(size_t)0x07 : REGION_CHUNK_DEFAULT;
+    return region;
+}
+
+/* Bumps the pointer, starting a new chunk when the current one is full */
+void *region_alloc(Region *region, size_t size) {
+    if (size > REGION_MAX_SIZE) {
+        return NULL;
+    }
+    size = size ? (size + 7) & ~(size_t)0x07 : 8;
+
+    if (size > (size_t)(region->end - region->cur)) {
+        // Large requests get a chunk of their own, so the current chunk is not abandoned
+        if (size > region->chunk_size / 4) {
+            Chunk *chunk = chunk_create(size);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->next = region->large;
+            region->large = chunk;
+            return CHUNK_DATA(chunk);
+        }
+
+        Chunk *chunk = chunk_create(region->chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = region->chunks;
+        region->chunks = chunk;
+        region->cur = CHUNK_DATA(chunk);
+        region->end = chunk->end;
+
+        // Grow geometrically so long-lived regions need few chunks
+        if (region->chunk_size < REGION_CHUNK_MAX) {
+            region->chunk_size *= 2;
+        }
+    }
+
+    void *ptr = region->cur;
+    region->cur += size;
+    return ptr;
+}
+
+RegionMark region_mark(Region *region) {
+    RegionMark mark = { region->chunks, region->large, region->cur };
+    return mark;
+}
+
+/* Frees the chunks taken since the mark and rewinds the bump pointer into the marked chunk */
+void region_release(Region *region, RegionMark mark) {
+    chunk_free_until(&region->large, mark.large);
+    chunk_free_until(&region->chunks, mark.chunk);
+
+    if (region->chunks != NULL) {
+        region->cur = mark.cur;
+        region->end = region->chunks->end;
+    } else {
+        region->cur = NULL;
+        region->end = NULL;
+    }
+}
+
+/* Frees every allocation; the newest (largest) bump chunk stays for the next round */
+void region_reset(Region *region) {
+    chunk_free_until(&region->large, NULL);
+    if (region->chunks == NULL) {
+        return;
+    }
+
+    chunk_free_until(&region->chunks->next, NULL);
+    region->cur = CHUNK_DATA(region->chunks);
+    region->end = region->chunks->end;
+}
+
+void region_destroy(Region *region) {
+    if (!region) return;
+
+    chunk_free_until(&region->large, NULL);
+    chunk_free_until(&region->chunks, NULL);
+    simple_free(region);
+}
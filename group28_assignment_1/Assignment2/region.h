@@ -0,0 +1,71 @@
+/**
+ * @file   region.h
+ * @brief  Regions for request-scoped allocations on the simple_malloc arena.
+ *
+ * A region hands out memory with a bump pointer from chunks taken from the
+ * arena, and frees everything at once: region_reset and region_release cost
+ * one simple_free per chunk, never per object. A region is not locked and
+ * must be used by one thread at a time.
+ */
+
+#ifndef REGION_H_
+#define REGION_H_
+
+#include <stddef.h>
+
+#define REGION_CHUNK_DEFAULT  (16 * 1024)   // First chunk size; later chunks double up to 1 MB
+
+typedef struct region Region;  // Opaque type
+
+/* Position in a region, taken by region_mark and restored by region_release */
+typedef struct region_mark {
+    void *chunk;
+    void *large;
+    char *cur;
+} RegionMark;
+
+
+/**
+ * @name    region_create
+ * @brief   Creates an empty region whose first chunk holds chunk_size bytes (0 selects the default).
+ * @retval  Handle to the region, or NULL if memory ran out.
+ */
+Region * region_create(size_t chunk_size);
+
+
+/**
+ * @name    region_alloc
+ * @brief   Allocates size bytes from the region. Memory is 8-byte aligned and cannot be freed on its own.
+ * @retval  Pointer to the memory, or NULL if size is too large or no chunk could be allocated.
+ */
+void * region_alloc(Region * region, size_t size);
+
+
+/**
+ * @name    region_mark
+ * @brief   Records the current position of the region.
+ */
+RegionMark region_mark(Region * region);
+
+
+/**
+ * @name    region_release
+ * @brief   Frees everything allocated since mark was taken, giving newer chunks back to the arena.
+ */
+void region_release(Region * region, RegionMark mark);
+
+
+/**
+ * @name    region_reset
+ * @brief   Frees everything in the region, keeping only its newest chunk for reuse.
+ */
+void region_reset(Region * region);
+
+
+/**
+ * @name    region_destroy
+ * @brief   Gives every chunk and the region itself back to the arena.
+ */
+void region_destroy(Region * region);
+
+#endif /* REGION_H_ */
@@ -0,0 +1,168 @@
+#include <stdint.h>
+#include "mm.h"
+#include "slab.h"
+
+#ifdef MM_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+/* Header at the start of every slab; the objects follow it */
+typedef struct slab {
+    struct slab *next;       // Neighbours in the cache's partial or full list
+    struct slab *prev;
+    void *free_objects;      // Stack of released objects, linked through their first word
+    uint16_t carved;         // Objects handed out at least once; the rest are untouched
+    uint16_t in_use;         // Objects currently allocated
+} Slab;
+
+struct slab_cache {
+    size_t object_size;
+    uint16_t per_slab;       // Objects that fit in one slab
+    Slab *partial;           // Slabs with at least one free object
+    Slab *full;              // Slabs with none
+    Slab *empty;             // At most one spare slab kept to absorb alloc/free churn
+#ifdef MM_THREAD_SAFE
+    pthread_mutex_t lock;
+#endif
+};
+
+#ifdef MM_THREAD_SAFE
+#define CACHE_LOCK(c)   pthread_mutex_lock(&(c)->lock)
+#define CACHE_UNLOCK(c) pthread_mutex_unlock(&(c)->lock)
+#else
+#define CACHE_LOCK(c)
+#define CACHE_UNLOCK(c)
+#endif
+
+#define SLAB_OF(obj)    ((Slab *)((uintptr_t)(obj) & ~(uintptr_t)(SLAB_SIZE - 1)))
+#define SLAB_HEADER     ((sizeof(Slab) + 7) & ~0x07)
+#define OBJECTS(s)      ((char *)(s) + SLAB_HEADER)
+
+static void list_push(Slab **list, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void list_remove(Slab **list, Slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/* Creates a cache for objects of object_size bytes */
+SlabCache *slab_cache_create(size_t object_size) {
+    if (object_size == 0 || object_size > SLAB_SIZE / 8) {
+        return NULL;
+    }
+
+    SlabCache *cache = simple_malloc(sizeof(SlabCache));
+    if (!cache) return NULL;
+
+    // Objects must hold the free stack link and stay 8-byte aligned
+    cache->object_size = (object_size + 7) & ~0x07;
+    cache->per_slab = (SLAB_SIZE - SLAB_HEADER) / cache->object_size;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+#ifdef MM_THREAD_SAFE
+    pthread_mutex_init(&cache->lock, NULL);
+#endif
+    return cache;
+}
+
+/* Allocates one object, taking a new slab from the arena only when none has room */
+void *slab_alloc(SlabCache *cache) {
+    CACHE_LOCK(cache);
+
+    Slab *slab = cache->partial;
+    if (slab == NULL) {
+        slab = cache->empty;
+        if (slab != NULL) {
+            cache->empty = NULL;
+        } else {
+            slab = simple_aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+            if (slab == NULL) {
+                CACHE_UNLOCK(cache);
+                return NULL;
+            }
+            slab->free_objects = NULL;
+            slab->carved = 0;
+            slab->in_use = 0;
+        }
+        list_push(&cache->partial, slab);
+    }
+
+    // Reuse a released object first, otherwise carve the next untouched one
+    void *object = slab->free_objects;
+    if (object != NULL) {
+        slab->free_objects = *(void **)object;
+    } else {
+        object = OBJECTS(slab) + (size_t)slab->carved * cache->object_size;
+        slab->carved++;
+    }
+
+    if (++slab->in_use == cache->per_slab) {
+        list_remove(&cache->partial, slab);
+        list_push(&cache->full, slab);
+    }
+
+    CACHE_UNLOCK(cache);
+    return object;
+}
+
+/* Returns an object to its slab, found by masking the object address */
+void slab_free(SlabCache *cache, void *object) {
+    if (!object) return;
+
+    Slab *slab = SLAB_OF(object);
+    CACHE_LOCK(cache);
+
+    *(void **)object = slab->free_objects;
+    slab->free_objects = object;
+
+    if (slab->in_use-- == cache->per_slab) {
+        list_remove(&cache->full, slab);
+        list_push(&cache->partial, slab);
+    }
+
+    // Keep one empty slab for reuse and give any other back to the arena
+    if (slab->in_use == 0) {
+        list_remove(&cache->partial, slab);
+        if (cache->empty == NULL) {
+            cache->empty = slab;
+        } else {
+            simple_free(slab);
+        }
+    }
+
+    CACHE_UNLOCK(cache);
+}
+
+/* Releases every slab and the cache itself */
+void slab_cache_destroy(SlabCache *cache) {
+    if (!cache) return;
+
+    Slab *lists[2] = { cache->partial, cache->full };
+    for (int i = 0; i < 2; i++) {
+        while (lists[i] != NULL) {
+            Slab *next = lists[i]->next;
+            simple_free(lists[i]);
+            lists[i] = next;
+        }
+    }
+    simple_free(cache->empty);
+
+#ifdef MM_THREAD_SAFE
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    simple_free(cache);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file   slab.h
+ * @brief  Object caches for small fixed-size allocations on the simple_malloc arena.
+ *
+ * A cache hands out objects of one size, packed into page-sized slabs that are
+ * carved from the arena with simple_aligned_alloc. Objects carry no per-object
+ * header, and allocation and release are O(1).
+ */
+
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+
+#define SLAB_SIZE   4096    // Bytes per slab, also its alignment in the arena
+
+typedef struct slab_cache SlabCache;  // Opaque type
+
+
+/**
+ * @name    slab_cache_create
+ * @brief   Creates a cache for objects of object_size bytes (at most SLAB_SIZE / 8).
+ * @retval  Handle to the cache, or NULL if the size is unsupported or memory ran out.
+ */
+SlabCache * slab_cache_create(size_t object_size);
+
+
+/**
+ * @name    slab_alloc
+ * @brief   Allocates one object from the cache. Objects are 8-byte aligned.
+ * @retval  Pointer to the object, or NULL if no slab could be allocated.
+ */
+void * slab_alloc(SlabCache * cache);
+
+
+/**
+ * @name    slab_free
+ * @brief   Returns an object obtained from slab_alloc on the same cache.
+ */
+void slab_free(SlabCache * cache, void * object);
+
+
+/**
+ * @name    slab_cache_destroy
+ * @brief   Releases every slab of the cache back to the arena, including live objects.
+ */
+void slab_cache_destroy(SlabCache * cache);
+
+#endif /* SLAB_H_ */